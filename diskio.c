@@ -11,11 +11,23 @@
 #include "ff.h"			/* Obtains integer types */
 #include "diskio.h"		/* Declarations of disk functions */
 #include "fftable.h"
+#include "ffcache.h"
+#include "fatcache.h"
+#include "freemap.h"
+#include "ffuring.h"
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 
+/* io_uring submission queue size (requests in a single submission) */
+#define URING_ENTRIES 64
+/* writes up to a page are absorbed by the sector cache */
+#define CACHE_ABSORB 8
+
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
 /*-----------------------------------------------------------------------*/
@@ -44,10 +56,28 @@ DSTATUS disk_initialize (
 	if (drv->flags & FFFF_RDONLY)
 		drv->fd = open(drv->path, O_RDONLY);
 	else
-		drv->fd = open(drv->path, O_SYNC|O_RDWR);
+		drv->fd = open(drv->path, (drv->flags & FFFF_SYNC_ALWAYS) ? O_SYNC|O_RDWR : O_RDWR);
 	if (drv->fd < 0)
 		return STA_NOINIT;
-	
+	if ((drv->flags & FFFF_MMAP) && drv->map == NULL) {
+		struct stat sbuf;
+		void *map;
+		if (fstat(drv->fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode) && sbuf.st_size > 0 &&
+				(map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, drv->fd, 0)) != MAP_FAILED) {
+			drv->map = map;
+			drv->mapsize = sbuf.st_size;
+		} else
+			fprintf(stderr, "%s: cannot map the image, using pread\n", drv->path);
+	}
+	if ((drv->flags & FFFF_URING) && drv->uring == NULL) {
+		drv->uring = ffuring_new(drv->fd, URING_ENTRIES);
+		if (drv->uring == NULL)
+			fprintf(stderr, "%s: io_uring unavailable, using pread/pwrite\n", drv->path);
+	}
+	/* the mapping is the cache */
+	if (drv->cachesize > 0 && drv->cache == NULL && drv->map == NULL)
+		drv->cache = ffcache_new(drv->fd, drv->cachesize, drv->dirtymax, drv->uring);
+
 	return RES_OK;
 }
 
@@ -73,9 +103,24 @@ DRESULT disk_read (
 #else
 	ssize = FF_MIN_SS;
 #endif
+	if (drv->map) {
+		if ((sector + count) * ssize > drv->mapsize)
+			return RES_ERROR;
+		memcpy(buff, drv->map + sector * ssize, count * ssize);
+		return RES_OK;
+	}
+	if (drv->fatcache) {
+		int rv = fatcache_read(drv->fatcache, buff, sector, count);
+		if (rv != 0)
+			return rv > 0 ? RES_OK : RES_ERROR;
+	}
+	if (drv->cache && count == 1)
+		return ffcache_read(drv->cache, buff, sector) == 0 ? RES_OK : RES_ERROR;
 	ssize_t size = count * ssize;
 	if (pread(drv->fd, buff, size, sector * ssize) != size)
 		return RES_ERROR;
+	if (drv->cache)
+		ffcache_overlay(drv->cache, buff, sector, count);
 
 	res = RES_OK;
 	return res;
@@ -106,9 +151,30 @@ DRESULT disk_write (
 #endif
 	if (drv->flags & FFFF_RDONLY)
 		return RES_WRPRT;
+	if (drv->freemap)
+		freemap_update(drv->freemap, buff, sector, count);
+	if (drv->freecount)
+		freecount_update(drv->freecount, buff, sector, count);
+	if (drv->fatcache) {
+		int rv = fatcache_write(drv->fatcache, buff, sector, count);
+		/* sync=always: the FAT sectors are written through at once */
+		if (rv > 0 && (drv->flags & FFFF_SYNC_ALWAYS))
+			rv = fatcache_flush(drv->fatcache) < 0 ? -1 : 1;
+		if (rv != 0)
+			return rv > 0 ? RES_OK : RES_ERROR;
+	}
+	if (drv->cache && count <= CACHE_ABSORB && !(drv->flags & FFFF_SYNC_ALWAYS)) {
+		UINT k;
+		for (k = 0; k < count; k++)
+			if (ffcache_write(drv->cache, buff + k * ssize, sector + k) != 0)
+				return RES_ERROR;
+		return RES_OK;
+	}
 	ssize_t size = count * ssize;
 	if (pwrite(drv->fd, buff, size, sector * ssize) != size)
 		return RES_ERROR;
+	if (drv->cache)
+		ffcache_update(drv->cache, buff, sector, count);
 
   res = RES_OK;
   return res;
@@ -132,6 +198,15 @@ DRESULT disk_ioctl (
 
 	switch (cmd) {
 		case CTRL_SYNC:
+			if (drv->nosync) {
+				drv->syncpending = 1;
+				return RES_OK;
+			}
+			if (fftab_flush(drv) < 0)
+				return RES_ERROR;
+			if (!(drv->flags & (FFFF_SYNC_ALWAYS | FFFF_SYNC_NONE)) && fdatasync(drv->fd) < 0)
+				return RES_ERROR;
+			drv->syncpending = 0;
 			return RES_OK;
 		case GET_SECTOR_SIZE:
 #if FF_MAX_SS != FF_MIN_SS
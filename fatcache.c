@@ -0,0 +1,212 @@
+/**
+ * Copyright (c) 2020 Renzo Davoli <renzo@cs.unibo.it>
+ *
+ * This program  is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ff.h>
+#include <ffcache.h>
+#include <fatcache.h>
+#include <ffuring.h>
+
+/* get_fat/put_fat access the FAT one sector at a time through the FatFs
+	 window. When the FAT is kept in memory a window change costs a memcpy
+	 instead of a disk read.
+	 All the copies of the FAT share the same in-memory image: each copy has
+	 its own dirty bitmap, dirty ranges are written back on flush */
+
+#define FATCACHE_SS FF_MAX_SS
+#define FATCACHE_IOSIZE (1 << 20)
+
+struct fatcache {
+	int fd;
+	struct ffuring *ring;
+	LBA_t fatbase;
+	DWORD fsize;
+	BYTE n_fats;
+	BYTE *fat;
+	uint64_t *dirty;
+	size_t dirtywords; // per copy
+	uint64_t flushed_sectors;
+	uint64_t flushed_runs;
+	/* ranges queued by fatcache_flush_queue */
+	uint64_t queued_sectors;
+	uint64_t queued_runs;
+};
+
+struct fatcache *fatcache_new(int fd, FATFS *fs, struct ffcache *cache, struct ffuring *ring) {
+	struct fatcache *fatcache = calloc(1, sizeof(*fatcache));
+	size_t fatlen = (size_t) fs->fsize * FATCACHE_SS;
+	size_t pos;
+	if (fatcache == NULL)
+		return NULL;
+	fatcache->fd = fd;
+	fatcache->ring = ring;
+	fatcache->fatbase = fs->fatbase;
+	fatcache->fsize = fs->fsize;
+	fatcache->n_fats = fs->n_fats;
+	fatcache->dirtywords = (fs->fsize + 63) / 64;
+	fatcache->fat = malloc(fatlen);
+	fatcache->dirty = calloc(fatcache->dirtywords * fs->n_fats, sizeof(uint64_t));
+	if (fatcache->fat == NULL || fatcache->dirty == NULL)
+		goto err;
+	for (pos = 0; pos < fatlen; ) {
+		size_t len = fatlen - pos < FATCACHE_IOSIZE ? fatlen - pos : FATCACHE_IOSIZE;
+		ssize_t n = pread(fd, fatcache->fat + pos, len, fs->fatbase * FATCACHE_SS + pos);
+		if (n <= 0)
+			goto err;
+		pos += n;
+	}
+	if (cache)
+		ffcache_overlay(cache, fatcache->fat, fs->fatbase, fs->fsize);
+	return fatcache;
+err:
+	free(fatcache->fat);
+	free(fatcache->dirty);
+	free(fatcache);
+	return NULL;
+}
+
+int fatcache_free(struct fatcache *fatcache) {
+	int rv = fatcache_flush(fatcache);
+	free(fatcache->fat);
+	free(fatcache->dirty);
+	free(fatcache);
+	return rv;
+}
+
+static int fatcache_range(struct fatcache *fatcache, LBA_t sector, UINT count) {
+	LBA_t fatend = fatcache->fatbase + (LBA_t) fatcache->fsize * fatcache->n_fats;
+	if (sector < fatcache->fatbase || sector + count > fatend) {
+		if (sector < fatend && sector + count > fatcache->fatbase)
+			return -1; // partial overlap: never generated by FatFs
+		return 0;
+	}
+	return 1;
+}
+
+int fatcache_read(struct fatcache *fatcache, BYTE *buff, LBA_t sector, UINT count) {
+	int rv = fatcache_range(fatcache, sector, count);
+	UINT k;
+	if (rv <= 0)
+		return rv;
+	for (k = 0; k < count; k++) {
+		DWORD fatsect = (sector + k - fatcache->fatbase) % fatcache->fsize;
+		memcpy(buff + (size_t) k * FATCACHE_SS, fatcache->fat + (size_t) fatsect * FATCACHE_SS, FATCACHE_SS);
+	}
+	return 1;
+}
+
+int fatcache_write(struct fatcache *fatcache, const BYTE *buff, LBA_t sector, UINT count) {
+	int rv = fatcache_range(fatcache, sector, count);
+	UINT k;
+	if (rv <= 0)
+		return rv;
+	for (k = 0; k < count; k++) {
+		DWORD copy = (sector + k - fatcache->fatbase) / fatcache->fsize;
+		DWORD fatsect = (sector + k - fatcache->fatbase) % fatcache->fsize;
+		uint64_t *dirty = fatcache->dirty + copy * fatcache->dirtywords;
+		memcpy(fatcache->fat + (size_t) fatsect * FATCACHE_SS, buff + (size_t) k * FATCACHE_SS, FATCACHE_SS);
+		dirty[fatsect / 64] |= 1ULL << (fatsect % 64);
+	}
+	return 1;
+}
+
+/* the next run of dirty sectors of a copy starting from *fatsect, 0 if none */
+static DWORD next_run(struct fatcache *fatcache, uint64_t *dirty, DWORD *fatsect) {
+	DWORD run;
+	while (*fatsect < fatcache->fsize) {
+		uint64_t word = dirty[*fatsect / 64] >> (*fatsect % 64);
+		if (word == 0) { // skip to the next word
+			*fatsect = (*fatsect / 64 + 1) * 64;
+			continue;
+		}
+		*fatsect += __builtin_ctzll(word);
+		for (run = 1; *fatsect + run < fatcache->fsize &&
+				(dirty[(*fatsect + run) / 64] & (1ULL << ((*fatsect + run) % 64))); run++)
+			;
+		return run;
+	}
+	return 0;
+}
+
+/* all the dirty ranges of all the copies in flight together */
+void fatcache_flush_queue(struct fatcache *fatcache, struct ffuring_batch *batch) {
+	BYTE copy;
+	DWORD fatsect, run;
+	fatcache->queued_sectors = fatcache->queued_runs = 0;
+	for (copy = 0; copy < fatcache->n_fats; copy++) {
+		uint64_t *dirty = fatcache->dirty + copy * fatcache->dirtywords;
+		LBA_t copybase = fatcache->fatbase + (LBA_t) copy * fatcache->fsize;
+		for (fatsect = 0; (run = next_run(fatcache, dirty, &fatsect)) > 0; fatsect += run) {
+			ffuring_write(batch, fatcache->fat + (size_t) fatsect * FATCACHE_SS,
+					(size_t) run * FATCACHE_SS, (copybase + fatsect) * FATCACHE_SS);
+			fatcache->queued_sectors += run;
+			fatcache->queued_runs++;
+		}
+	}
+}
+
+static int flush_pwrite(struct fatcache *fatcache) {
+	int rv = 0;
+	BYTE copy;
+	for (copy = 0; copy < fatcache->n_fats; copy++) {
+		uint64_t *dirty = fatcache->dirty + copy * fatcache->dirtywords;
+		LBA_t copybase = fatcache->fatbase + (LBA_t) copy * fatcache->fsize;
+		DWORD fatsect, run;
+		for (fatsect = 0; (run = next_run(fatcache, dirty, &fatsect)) > 0; fatsect += run) {
+			size_t len = (size_t) run * FATCACHE_SS;
+			if (pwrite(fatcache->fd, fatcache->fat + (size_t) fatsect * FATCACHE_SS, len,
+						(copybase + fatsect) * FATCACHE_SS) != (ssize_t) len) {
+				rv = -1; // keep the range dirty
+				continue;
+			}
+			for (DWORD k = fatsect; k < fatsect + run; k++)
+				dirty[k / 64] &= ~(1ULL << (k % 64));
+			fatcache->flushed_sectors += run;
+			fatcache->flushed_runs++;
+		}
+	}
+	return rv;
+}
+
+int fatcache_flush_done(struct fatcache *fatcache, int rv) {
+	/* in case of error the ranges are written again one by one */
+	if (rv < 0)
+		return flush_pwrite(fatcache);
+	memset(fatcache->dirty, 0, fatcache->dirtywords * fatcache->n_fats * sizeof(uint64_t));
+	fatcache->flushed_sectors += fatcache->queued_sectors;
+	fatcache->flushed_runs += fatcache->queued_runs;
+	return 0;
+}
+
+int fatcache_flush(struct fatcache *fatcache) {
+	struct ffuring_batch batch;
+	if (fatcache->ring == NULL)
+		return flush_pwrite(fatcache);
+	ffuring_begin(fatcache->ring, &batch);
+	fatcache_flush_queue(fatcache, &batch);
+	return fatcache_flush_done(fatcache, ffuring_end(&batch));
+}
+
+void fatcache_stats(struct fatcache *fatcache, FILE *f) {
+	fprintf(f, "FAT cache: %u sectors x %u copies, %llu sectors written back in %llu runs\n",
+			fatcache->fsize, fatcache->n_fats,
+			(unsigned long long) fatcache->flushed_sectors, (unsigned long long) fatcache->flushed_runs);
+}
@@ -0,0 +1,33 @@
+#ifndef FATCACHE_H
+#define FATCACHE_H
+#include <stdio.h>
+#include <stdint.h>
+#include <ff.h>
+
+/* In-memory mirror of the whole FAT of a FAT12/16/32 volume */
+struct fatcache;
+
+struct ffcache;
+struct ffuring;
+/* load the FAT (sectors not yet written back to the image are taken from cache).
+	 Flushes use ring (if not NULL) to write all the FAT copies in a single submission */
+struct fatcache *fatcache_new(int fd, FATFS *fs, struct ffcache *cache, struct ffuring *ring);
+/* flush dirty sectors and free the mirror. It returns -1 if the flush failed */
+int fatcache_free(struct fatcache *fatcache);
+
+/* These functions return 0 if the range of sectors is not in the FAT area,
+	 1 if the operation has been completed, -1 in case of I/O error */
+int fatcache_read(struct fatcache *fatcache, BYTE *buff, LBA_t sector, UINT count);
+int fatcache_write(struct fatcache *fatcache, const BYTE *buff, LBA_t sector, UINT count);
+
+/* write back the dirty ranges of all the FAT copies */
+int fatcache_flush(struct fatcache *fatcache);
+/* the same in two steps, to share an io_uring batch (the FAT must not change
+	 in between): fatcache_flush_done gets the result of ffuring_end */
+struct ffuring_batch;
+void fatcache_flush_queue(struct fatcache *fatcache, struct ffuring_batch *batch);
+int fatcache_flush_done(struct fatcache *fatcache, int rv);
+
+void fatcache_stats(struct fatcache *fatcache, FILE *f);
+
+#endif
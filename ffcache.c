@@ -0,0 +1,413 @@
+/**
+ * Copyright (c) 2020 Renzo Davoli <renzo@cs.unibo.it>
+ *
+ * This program  is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <ff.h>
+#include <ffcache.h>
+#include <ffuring.h>
+
+/* All the metadata (FAT, exFAT bitmap, directories) goes through the single
+	 sector window of FatFs (fs->win): each window change is a disk_read of one
+	 sector. This cache keeps the most recently used sectors in memory.
+	 Writes are delayed until the next flush (CTRL_SYNC, timer, more than
+	 dirtymax dirty sectors) or eviction: small data writes are absorbed too
+	 (see disk_write) and adjacent dirty sectors are written back together.
+	 The cache is shared by the lanes of a read-only volume (see fusefatfs.c):
+	 it has its own mutex, released while reading a missing sector */
+
+#define FFCACHE_SS FF_MAX_SS
+#define NIL UINT32_MAX
+
+struct ffcache_entry {
+	LBA_t sector;
+	uint32_t hnext;
+	uint32_t prev;
+	uint32_t next;
+	int dirty;
+};
+
+struct ffcache {
+	pthread_mutex_t mutex;
+	int fd;
+	struct ffuring *ring;
+	uint32_t nentries;
+	uint32_t nused;
+	uint32_t ndirty;
+	uint32_t dirtymax;
+	uint32_t hmask;
+	uint32_t *htable;
+	uint32_t head; // most recently used
+	uint32_t tail; // least recently used
+	uint32_t freelist;
+	struct ffcache_entry *entries;
+	BYTE *data;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t writebacks; // sectors
+	uint64_t writes; // write requests of the write backs
+	/* flush in progress: the dirty sectors sorted by LBA */
+	uint32_t nflush;
+	uint32_t *flushdirty;
+	struct iovec *flushiov;
+};
+
+static inline uint32_t hash(struct ffcache *cache, LBA_t sector) {
+	return (uint32_t) ((sector * 0x9E3779B97F4A7C15ULL) >> 32) & cache->hmask;
+}
+
+static inline BYTE *entry_data(struct ffcache *cache, uint32_t i) {
+	return cache->data + (size_t) i * FFCACHE_SS;
+}
+
+static uint32_t lookup(struct ffcache *cache, LBA_t sector) {
+	uint32_t i;
+	for (i = cache->htable[hash(cache, sector)]; i != NIL; i = cache->entries[i].hnext)
+		if (cache->entries[i].sector == sector)
+			break;
+	return i;
+}
+
+static void lru_unlink(struct ffcache *cache, uint32_t i) {
+	struct ffcache_entry *e = &cache->entries[i];
+	if (e->prev != NIL) cache->entries[e->prev].next = e->next; else cache->head = e->next;
+	if (e->next != NIL) cache->entries[e->next].prev = e->prev; else cache->tail = e->prev;
+}
+
+static void lru_push(struct ffcache *cache, uint32_t i) {
+	struct ffcache_entry *e = &cache->entries[i];
+	e->prev = NIL;
+	e->next = cache->head;
+	if (cache->head != NIL) cache->entries[cache->head].prev = i; else cache->tail = i;
+	cache->head = i;
+}
+
+static void hash_unlink(struct ffcache *cache, uint32_t i) {
+	uint32_t *scan;
+	for (scan = &cache->htable[hash(cache, cache->entries[i].sector)]; *scan != i;
+			scan = &cache->entries[*scan].hnext)
+		;
+	*scan = cache->entries[i].hnext;
+}
+
+static int writeback(struct ffcache *cache, uint32_t i) {
+	struct ffcache_entry *e = &cache->entries[i];
+	if (pwrite(cache->fd, entry_data(cache, i), FFCACHE_SS, e->sector * FFCACHE_SS) != FFCACHE_SS)
+		return -1;
+	e->dirty = 0;
+	cache->ndirty--;
+	cache->writebacks++;
+	cache->writes++;
+	return 0;
+}
+
+/* get a free entry for sector: the least recently used one is evicted when the cache is full */
+static uint32_t alloc_entry(struct ffcache *cache, LBA_t sector) {
+	uint32_t i;
+	if (cache->freelist != NIL) {
+		i = cache->freelist;
+		cache->freelist = cache->entries[i].next;
+	} else if (cache->nused < cache->nentries)
+		i = cache->nused++;
+	else {
+		i = cache->tail;
+		if (cache->entries[i].dirty && writeback(cache, i) < 0)
+			return NIL;
+		lru_unlink(cache, i);
+		hash_unlink(cache, i);
+	}
+	uint32_t h = hash(cache, sector);
+	cache->entries[i].sector = sector;
+	cache->entries[i].dirty = 0;
+	cache->entries[i].hnext = cache->htable[h];
+	cache->htable[h] = i;
+	lru_push(cache, i);
+	return i;
+}
+
+static void touch(struct ffcache *cache, uint32_t i) {
+	if (cache->head != i) {
+		lru_unlink(cache, i);
+		lru_push(cache, i);
+	}
+}
+
+struct ffcache *ffcache_new(int fd, size_t size, size_t dirtymax, struct ffuring *ring) {
+	uint32_t nentries = size / FFCACHE_SS;
+	uint32_t hsize;
+	struct ffcache *cache;
+	if (nentries == 0)
+		return NULL;
+	for (hsize = 1; hsize < nentries; hsize <<= 1)
+		;
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+	cache->fd = fd;
+	cache->ring = ring;
+	cache->nentries = nentries;
+	cache->dirtymax = dirtymax / FFCACHE_SS;
+	if (cache->dirtymax == 0 || cache->dirtymax > nentries)
+		cache->dirtymax = nentries;
+	cache->hmask = hsize - 1;
+	cache->head = cache->tail = cache->freelist = NIL;
+	cache->htable = malloc(hsize * sizeof(uint32_t));
+	cache->entries = malloc(nentries * sizeof(struct ffcache_entry));
+	cache->data = malloc((size_t) nentries * FFCACHE_SS);
+	if (cache->htable == NULL || cache->entries == NULL || cache->data == NULL) {
+		free(cache->htable);
+		free(cache->entries);
+		free(cache->data);
+		free(cache);
+		return NULL;
+	}
+	memset(cache->htable, 0xff, hsize * sizeof(uint32_t));
+	pthread_mutex_init(&cache->mutex, NULL);
+	return cache;
+}
+
+int ffcache_free(struct ffcache *cache) {
+	int rv = ffcache_flush(cache);
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache->htable);
+	free(cache->entries);
+	free(cache->data);
+	free(cache);
+	return rv;
+}
+
+int ffcache_read(struct ffcache *cache, BYTE *buff, LBA_t sector) {
+	uint32_t i;
+	pthread_mutex_lock(&cache->mutex);
+	i = lookup(cache, sector);
+	if (i != NIL) {
+		cache->hits++;
+		touch(cache, i);
+		memcpy(buff, entry_data(cache, i), FFCACHE_SS);
+	} else {
+		cache->misses++;
+		pthread_mutex_unlock(&cache->mutex);
+		if (pread(cache->fd, buff, FFCACHE_SS, sector * FFCACHE_SS) != FFCACHE_SS)
+			return -1;
+		pthread_mutex_lock(&cache->mutex);
+		/* another lane may have loaded the same sector in the meantime */
+		if ((i = lookup(cache, sector)) != NIL) {
+			touch(cache, i);
+			memcpy(buff, entry_data(cache, i), FFCACHE_SS);
+		} else if ((i = alloc_entry(cache, sector)) != NIL)
+			memcpy(entry_data(cache, i), buff, FFCACHE_SS);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return 0;
+}
+
+static int flush(struct ffcache *cache);
+
+int ffcache_write(struct ffcache *cache, const BYTE *buff, LBA_t sector) {
+	uint32_t i;
+	pthread_mutex_lock(&cache->mutex);
+	i = lookup(cache, sector);
+	if (i != NIL)
+		touch(cache, i);
+	else if ((i = alloc_entry(cache, sector)) == NIL) {
+		pthread_mutex_unlock(&cache->mutex);
+		return -1;
+	}
+	memcpy(entry_data(cache, i), buff, FFCACHE_SS);
+	if (!cache->entries[i].dirty) {
+		cache->entries[i].dirty = 1;
+		cache->ndirty++;
+	}
+	/* the sector is in the cache: a failure will show up at the next flush */
+	if (cache->ndirty > cache->dirtymax)
+		flush(cache);
+	pthread_mutex_unlock(&cache->mutex);
+	return 0;
+}
+
+void ffcache_overlay(struct ffcache *cache, BYTE *buff, LBA_t sector, UINT count) {
+	UINT k;
+	pthread_mutex_lock(&cache->mutex);
+	if (cache->ndirty > 0) {
+		for (k = 0; k < count; k++) {
+			uint32_t i = lookup(cache, sector + k);
+			if (i != NIL && cache->entries[i].dirty)
+				memcpy(buff + (size_t) k * FFCACHE_SS, entry_data(cache, i), FFCACHE_SS);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void ffcache_update(struct ffcache *cache, const BYTE *buff, LBA_t sector, UINT count) {
+	UINT k;
+	pthread_mutex_lock(&cache->mutex);
+	for (k = 0; k < count && cache->nused > 0; k++) {
+		uint32_t i = lookup(cache, sector + k);
+		if (i != NIL) {
+			memcpy(entry_data(cache, i), buff + (size_t) k * FFCACHE_SS, FFCACHE_SS);
+			if (cache->entries[i].dirty) {
+				cache->entries[i].dirty = 0;
+				cache->ndirty--;
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+static int cmp_sector(const void *a, const void *b, void *arg) {
+	struct ffcache *cache = arg;
+	LBA_t sa = cache->entries[*(const uint32_t *) a].sector;
+	LBA_t sb = cache->entries[*(const uint32_t *) b].sector;
+	return (sa > sb) - (sa < sb);
+}
+
+/* the length of the run of contiguous sectors starting at dirty[0] */
+static uint32_t run_length(struct ffcache *cache, uint32_t *dirty, uint32_t n) {
+	uint32_t len;
+	for (len = 1; len < n && len < IOV_MAX &&
+			cache->entries[dirty[len]].sector == cache->entries[dirty[len - 1]].sector + 1; len++)
+		;
+	return len;
+}
+
+static void clean_run(struct ffcache *cache, uint32_t *dirty, uint32_t len) {
+	uint32_t k;
+	for (k = 0; k < len; k++)
+		cache->entries[dirty[k]].dirty = 0;
+	cache->ndirty -= len;
+	cache->writebacks += len;
+	cache->writes++;
+}
+
+/* sort the dirty sectors. It returns -1 if there is no memory to sort them */
+static int flush_sort(struct ffcache *cache) {
+	uint32_t i, n;
+	cache->nflush = 0;
+	cache->flushdirty = malloc(cache->ndirty * sizeof(uint32_t));
+	cache->flushiov = malloc(cache->ndirty * sizeof(struct iovec));
+	if (cache->flushdirty == NULL || cache->flushiov == NULL) {
+		free(cache->flushdirty);
+		free(cache->flushiov);
+		cache->flushdirty = NULL;
+		cache->flushiov = NULL;
+		return -1;
+	}
+	for (i = n = 0; i < cache->nused; i++)
+		if (cache->entries[i].dirty)
+			cache->flushdirty[n++] = i;
+	qsort_r(cache->flushdirty, n, sizeof(uint32_t), cmp_sector, cache);
+	for (i = 0; i < n; i++) {
+		cache->flushiov[i].iov_base = entry_data(cache, cache->flushdirty[i]);
+		cache->flushiov[i].iov_len = FFCACHE_SS;
+	}
+	cache->nflush = n;
+	return 0;
+}
+
+/* all the runs in flight together */
+static void flush_queue(struct ffcache *cache, struct ffuring_batch *batch) {
+	uint32_t *dirty = cache->flushdirty;
+	uint32_t i, len, n = cache->nflush;
+	for (i = 0; i < n; i += len) {
+		len = run_length(cache, dirty + i, n - i);
+		ffuring_writev(batch, cache->flushiov + i, len, cache->entries[dirty[i]].sector * FFCACHE_SS);
+	}
+}
+
+/* uring_rv: the result of ffuring_end (-1 if the runs have not been queued).
+	 In case of error the runs are written again one by one */
+static int flush_done(struct ffcache *cache, int uring_rv) {
+	uint32_t *dirty = cache->flushdirty;
+	uint32_t i, len, n = cache->nflush;
+	int rv = 0;
+	if (dirty == NULL) {
+		/* no memory to sort the sectors: write them in LRU order */
+		for (i = cache->head; i != NIL; i = cache->entries[i].next)
+			if (cache->entries[i].dirty && writeback(cache, i) < 0)
+				rv = -1;
+		return rv;
+	}
+	for (i = 0; i < n; i += len) {
+		len = run_length(cache, dirty + i, n - i);
+		if (uring_rv == 0 ||
+				pwritev(cache->fd, cache->flushiov + i, len,
+					cache->entries[dirty[i]].sector * FFCACHE_SS) == (ssize_t) len * FFCACHE_SS)
+			clean_run(cache, dirty + i, len);
+		else
+			rv = -1;
+	}
+	free(cache->flushiov);
+	free(cache->flushdirty);
+	cache->flushiov = NULL;
+	cache->flushdirty = NULL;
+	cache->nflush = 0;
+	return rv;
+}
+
+static int flush(struct ffcache *cache) {
+	struct ffuring_batch batch;
+	int uring_rv = -1;
+	if (cache->ndirty == 0)
+		return 0;
+	if (flush_sort(cache) == 0 && cache->ring) {
+		ffuring_begin(cache->ring, &batch);
+		flush_queue(cache, &batch);
+		uring_rv = ffuring_end(&batch);
+	}
+	return flush_done(cache, uring_rv);
+}
+
+int ffcache_flush(struct ffcache *cache) {
+	int rv;
+	pthread_mutex_lock(&cache->mutex);
+	rv = flush(cache);
+	pthread_mutex_unlock(&cache->mutex);
+	return rv;
+}
+
+void ffcache_flush_queue(struct ffcache *cache, struct ffuring_batch *batch) {
+	pthread_mutex_lock(&cache->mutex);
+	cache->nflush = 0;
+	if (cache->ndirty > 0 && flush_sort(cache) == 0)
+		flush_queue(cache, batch);
+}
+
+int ffcache_flush_done(struct ffcache *cache, int rv) {
+	if (cache->ndirty > 0)
+		rv = flush_done(cache, rv);
+	else
+		rv = 0;
+	pthread_mutex_unlock(&cache->mutex);
+	return rv;
+}
+
+void ffcache_stats(struct ffcache *cache, FILE *f) {
+	uint64_t total = cache->hits + cache->misses;
+	fprintf(f, "sector cache: %u/%u sectors, %llu hits, %llu misses (%.1f%% hit rate), "
+			"%llu writebacks in %llu writes (%.1f sectors/write)\n",
+			cache->nused, cache->nentries,
+			(unsigned long long) cache->hits, (unsigned long long) cache->misses,
+			total ? 100.0 * cache->hits / total : 0.0,
+			(unsigned long long) cache->writebacks, (unsigned long long) cache->writes,
+			cache->writes ? (double) cache->writebacks / cache->writes : 0.0);
+}
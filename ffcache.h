@@ -0,0 +1,35 @@
+#ifndef FFCACHE_H
+#define FFCACHE_H
+#include <stdio.h>
+#include <stdint.h>
+#include <ff.h>
+
+/* LRU write-back cache of single sectors, keyed by LBA */
+struct ffcache;
+
+struct ffuring;
+/* flushes use ring (if not NULL) to write back the dirty sectors in a single submission.
+	 The cache is flushed when more than dirtymax bytes are dirty (0 means no limit) */
+struct ffcache *ffcache_new(int fd, size_t size, size_t dirtymax, struct ffuring *ring);
+/* flush dirty sectors and free the cache. It returns -1 if the flush failed */
+int ffcache_free(struct ffcache *cache);
+
+/* single sector access: ffcache_read returns -1 in case of I/O error */
+int ffcache_read(struct ffcache *cache, BYTE *buff, LBA_t sector);
+int ffcache_write(struct ffcache *cache, const BYTE *buff, LBA_t sector);
+
+/* multi sector direct access: keep the cache consistent */
+void ffcache_overlay(struct ffcache *cache, BYTE *buff, LBA_t sector, UINT count);
+void ffcache_update(struct ffcache *cache, const BYTE *buff, LBA_t sector, UINT count);
+
+/* write back all the dirty sectors */
+int ffcache_flush(struct ffcache *cache);
+/* the same in two steps, to share an io_uring batch: the cache is locked
+	 in between, ffcache_flush_done gets the result of ffuring_end */
+struct ffuring_batch;
+void ffcache_flush_queue(struct ffcache *cache, struct ffuring_batch *batch);
+int ffcache_flush_done(struct ffcache *cache, int rv);
+
+void ffcache_stats(struct ffcache *cache, FILE *f);
+
+#endif
@@ -0,0 +1,105 @@
+/*------------------------------------------------------------------------*/
+/* User Provided OS Dependent Functions for FatFs                         */
+/* Customized for fusefatfs: POSIX threads                                */
+/*------------------------------------------------------------------------*/
+
+#include "ff.h"
+
+
+#if FF_FS_REENTRANT	/* Mutal exclusion */
+/*------------------------------------------------------------------------*/
+/* Definitions of Mutex                                                   */
+/*------------------------------------------------------------------------*/
+/* fusefatfs holds the volume mutex across sequences of FatFs calls
+/  (e.g. f_lseek + f_read), so the mutexes are recursive.
+/  A FUSE request must not fail because the volume is busy:
+/  ff_mutex_take waits with no timeout, FF_FS_TIMEOUT is not used.
+*/
+
+#include <pthread.h>
+
+static pthread_mutex_t Mutex[FF_VOLUMES + 1];	/* Table of mutexes */
+
+
+
+/*------------------------------------------------------------------------*/
+/* Create a Mutex                                                         */
+/*------------------------------------------------------------------------*/
+/* This function is called in f_mount function to create a new mutex
+/  for the volume. When a 0 is returned, the f_mount function
+/  fails with FR_INT_ERR.
+*/
+
+int ff_mutex_create (	/* Returns 1:Function succeeded or 0:Could not create the mutex */
+	int vol				/* Mutex ID: Volume mutex (0 to FF_VOLUMES - 1) or system mutex (FF_VOLUMES) */
+)
+{
+	pthread_mutexattr_t attr;
+	int rv;
+
+	if (pthread_mutexattr_init(&attr) != 0) return 0;
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	rv = pthread_mutex_init(&Mutex[vol], &attr);
+	pthread_mutexattr_destroy(&attr);
+	return (int)(rv == 0);
+}
+
+
+/*------------------------------------------------------------------------*/
+/* Delete a Mutex                                                         */
+/*------------------------------------------------------------------------*/
+/* This function is called in f_mount function to delete a mutex
+/  of the volume created with ff_mutex_create function.
+*/
+
+void ff_mutex_delete (
+	int vol				/* Mutex ID: Volume mutex (0 to FF_VOLUMES - 1) or system mutex (FF_VOLUMES) */
+)
+{
+	pthread_mutex_destroy(&Mutex[vol]);
+}
+
+
+/*------------------------------------------------------------------------*/
+/* Request a Grant to Access the Volume                                   */
+/*------------------------------------------------------------------------*/
+/* This function is called on enter file functions to lock the volume.
+/  When a 0 is returned, the file function fails with FR_TIMEOUT.
+*/
+
+int ff_mutex_take (	/* Returns 1:Succeeded or 0:Error */
+	int vol			/* Mutex ID: Volume mutex (0 to FF_VOLUMES - 1) or system mutex (FF_VOLUMES) */
+)
+{
+	return (int)(pthread_mutex_lock(&Mutex[vol]) == 0);
+}
+
+
+/*------------------------------------------------------------------------*/
+/* Request a Grant to Access the Volume, if it is free                    */
+/*------------------------------------------------------------------------*/
+/* fusefatfs: used to choose a lane of a read-only volume.
+*/
+
+int ff_mutex_trytake (	/* Returns 1:Succeeded or 0:Busy */
+	int vol			/* Mutex ID: Volume mutex (0 to FF_VOLUMES - 1) or system mutex (FF_VOLUMES) */
+)
+{
+	return (int)(pthread_mutex_trylock(&Mutex[vol]) == 0);
+}
+
+
+/*------------------------------------------------------------------------*/
+/* Release a Grant to Access the Volume                                   */
+/*------------------------------------------------------------------------*/
+/* This function is called on leave file functions to unlock the volume.
+*/
+
+void ff_mutex_give (
+	int vol			/* Mutex ID: Volume mutex (0 to FF_VOLUMES - 1) or system mutex (FF_VOLUMES) */
+)
+{
+	pthread_mutex_unlock(&Mutex[vol]);
+}
+
+#endif	/* FF_FS_REENTRANT */
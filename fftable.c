@@ -19,8 +19,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <ff.h>
 #include <fftable.h>
+#include <ffcache.h>
+#include <fatcache.h>
+#include <freemap.h>
+#include <ffuring.h>
+#include <pathcache.h>
 
 static struct fftab *fftab[FF_VOLUMES];
 
@@ -39,6 +46,27 @@ int fftab_new(const char *path, int flags) {
 	new->fd = -1;
 	new->index = index;
 	new->flags = flags;
+	new->cachesize = 0;
+	new->dirtymax = 0;
+	new->uring = NULL;
+	new->map = NULL;
+	new->mapsize = 0;
+	new->cache = NULL;
+	new->fatcache = NULL;
+	new->freemap = NULL;
+	new->pathcache = NULL;
+	new->freecount = NULL;
+	new->freecount_running = 0;
+	new->flushtime = 0;
+	new->flusher_running = 0;
+	pthread_mutex_init(&new->flusher_mutex, NULL);
+	pthread_cond_init(&new->flusher_cond, NULL);
+	new->nosync = 0;
+	new->syncpending = 0;
+	new->files = NULL;
+	new->dirs = NULL;
+	new->nlanes = 0;
+	new->nextlane = 0;
 	memset(&new->fs, 0, sizeof(new->fs));
 	snprintf(new->path, pathlen, "%s", path);
 	fftab[index] = new;
@@ -49,10 +77,54 @@ void fftab_del(int index) {
 	if (index < 0) return;
 	if (index >= FF_VOLUMES) return;
 	if (fftab[index] == NULL) return;
+	if (fftab[index]->freemap != NULL)
+		freemap_free(fftab[index]->freemap);
+	if (fftab[index]->freecount != NULL)
+		freecount_free(fftab[index]->freecount);
+	if (fftab[index]->pathcache != NULL)
+		pathcache_free(fftab[index]->pathcache);
+	if (fftab[index]->fatcache != NULL && fatcache_free(fftab[index]->fatcache) < 0)
+		fprintf(stderr, "%s: FAT cache write back failed\n", fftab[index]->path);
+	if (fftab[index]->cache != NULL && ffcache_free(fftab[index]->cache) < 0)
+		fprintf(stderr, "%s: sector cache write back failed\n", fftab[index]->path);
+	if (fftab[index]->uring != NULL)
+		ffuring_free(fftab[index]->uring);
+	if (fftab[index]->map != NULL)
+		munmap(fftab[index]->map, fftab[index]->mapsize);
+	if (fftab[index]->fd >= 0 &&
+			!(fftab[index]->flags & (FFFF_RDONLY | FFFF_SYNC_ALWAYS | FFFF_SYNC_NONE)) &&
+			fdatasync(fftab[index]->fd) < 0)
+		fprintf(stderr, "%s: fdatasync failed\n", fftab[index]->path);
+	if (fftab[index]->fd >= 0)
+		close(fftab[index]->fd);
+	pthread_cond_destroy(&fftab[index]->flusher_cond);
+	pthread_mutex_destroy(&fftab[index]->flusher_mutex);
 	free(fftab[index]);
 	fftab[index] = NULL;
 }
 
+int fftab_flush(struct fftab *ffentry) {
+	int rv = 0;
+	if (ffentry->uring && ffentry->fatcache && ffentry->cache) {
+		/* the FAT copies and the dirty sectors in a single batch */
+		struct ffuring_batch batch;
+		ffuring_begin(ffentry->uring, &batch);
+		fatcache_flush_queue(ffentry->fatcache, &batch);
+		ffcache_flush_queue(ffentry->cache, &batch);
+		int uring_rv = ffuring_end(&batch);
+		if (fatcache_flush_done(ffentry->fatcache, uring_rv) < 0)
+			rv = -1;
+		if (ffcache_flush_done(ffentry->cache, uring_rv) < 0)
+			rv = -1;
+		return rv;
+	}
+	if (ffentry->fatcache && fatcache_flush(ffentry->fatcache) < 0)
+		rv = -1;
+	if (ffentry->cache && ffcache_flush(ffentry->cache) < 0)
+		rv = -1;
+	return rv;
+}
+
 struct fftab *fftab_get(int index) {
 	if (index < 0) return NULL;
 	if (index >= FF_VOLUMES) return NULL;
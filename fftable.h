@@ -1,13 +1,61 @@
 #ifndef FFTABLE_H
 #define FFTABLE_H
+#include <stddef.h>
+#include <pthread.h>
 #include <ff.h>
 
 #define FFFF_RDONLY 1
+#define FFFF_STATS 2
+#define FFFF_FATCACHE 4
+#define FFFF_URING 8
+#define FFFF_MMAP 16
+/* durability: the default (-o sync=fsync) is fdatasync on CTRL_SYNC, fsync and unmount */
+#define FFFF_SYNC_ALWAYS 32 // O_SYNC
+#define FFFF_SYNC_NONE 64 // leave it to the kernel
+
+struct ffcache;
+struct fatcache;
+struct freemap;
+struct freecount;
+struct ffuring;
+struct pathcache;
+struct fffile;
+struct fffdir;
 
 struct fftab {
 	int fd;
 	int index;
 	int flags;
+	size_t cachesize;
+	size_t dirtymax; // of the sector cache
+	struct ffuring *uring;
+	BYTE *map; // read-only mapping of the image
+	size_t mapsize;
+	struct ffcache *cache;
+	struct fatcache *fatcache;
+	struct freemap *freemap;
+	struct pathcache *pathcache;
+	struct freecount *freecount; // free clusters being counted
+	pthread_t freecount_thread;
+	int freecount_running;
+	/* write back of the sector cache every flushtime seconds */
+	unsigned int flushtime;
+	pthread_t flusher_thread;
+	int flusher_running;
+	pthread_mutex_t flusher_mutex;
+	pthread_cond_t flusher_cond;
+	/* CTRL_SYNC does not write back the caches (see fff_syncfile),
+		 syncpending records that one has been skipped */
+	int nosync;
+	int syncpending;
+	/* rw volumes: open files and directories (see fff_renamed) */
+	struct fffile *files;
+	struct fffdir *dirs;
+	/* read-only volumes: lane[0] is this entry, the others are further
+		 mounts of the same image sharing the caches */
+	int nlanes;
+	unsigned int nextlane;
+	struct fftab *lane[FF_VOLUMES];
 	FATFS fs;
 	char path[];
 };
@@ -15,5 +63,10 @@ struct fftab {
 int fftab_new(const char *path, int flags);
 void fftab_del(int index);
 struct fftab *fftab_get(int index);
+/* write back the FAT cache and the sector cache. It returns -1 in case of error */
+int fftab_flush(struct fftab *ffentry);
+
+/* ffsystem.c: non blocking ff_mutex_take */
+int ff_mutex_trytake(int vol);
 
 #endif
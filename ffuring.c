@@ -0,0 +1,328 @@
+/**
+ * Copyright (c) 2020 Renzo Davoli <renzo@cs.unibo.it>
+ *
+ * This program  is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ffuring.h>
+#include <config.h>
+
+/* pread/pwrite issue one request at a time. The requests of a batch
+	 (the fragments of a read, the dirty ranges of a flush) are queued
+	 in the submission ring and submitted with a single io_uring_enter.
+	 The raw kernel interface is used: no library is required.
+	 Concurrent batches share the ring: each request has a slot (its index is
+	 the user_data of the request) referring to its batch. One thread at a time
+	 waits for completions in the kernel, with the ring unlocked, and wakes
+	 up the others when their requests complete */
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define NOSLOT UINT32_MAX
+
+struct ffuring_slot {
+	struct ffuring_batch *batch;
+	size_t size; // bytes to transfer
+	uint32_t next; // free list
+};
+
+struct ffuring {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int waiting; // a thread is waiting for completions in the kernel
+	int ringfd;
+	int fd;
+	unsigned entries;
+	unsigned queued; // in the submission ring, not submitted yet
+	unsigned inflight; // submitted, not completed yet
+	struct ffuring_slot *slots; // one per entry: the completion ring cannot overflow
+	uint32_t freeslot;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	uint64_t submissions;
+	uint64_t requests;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int ringfd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, ringfd, to_submit, min_complete, flags, NULL, 0);
+}
+
+struct ffuring *ffuring_new(int fd, unsigned entries) {
+	struct io_uring_params p;
+	struct ffuring *ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	ring->fd = fd;
+	ring->ringfd = io_uring_setup(entries, &p);
+	if (ring->ringfd < 0) {
+		free(ring);
+		return NULL;
+	}
+	ring->entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err_close;
+	if (ring->cq_ring_size == 0)
+		ring->cq_ring = ring->sq_ring;
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_cq;
+	ring->sq_head = (unsigned *) ((char *) ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) ((char *) ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned *) ((char *) ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + p.cq_off.cqes);
+	ring->slots = malloc(ring->entries * sizeof(*ring->slots));
+	if (ring->slots == NULL)
+		goto err_sqes;
+	for (unsigned i = 0; i < ring->entries; i++)
+		ring->slots[i].next = i + 1 < ring->entries ? i + 1 : NOSLOT;
+	ring->freeslot = 0;
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	return ring;
+err_sqes:
+	munmap(ring->sqes, ring->sqes_size);
+err_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+err_close:
+	close(ring->ringfd);
+	free(ring);
+	return NULL;
+}
+
+void ffuring_free(struct ffuring *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->ringfd);
+	pthread_mutex_destroy(&ring->mutex);
+	pthread_cond_destroy(&ring->cond);
+	free(ring->slots);
+	free(ring);
+}
+
+/* the request of slot has completed (res < 0: it has not been submitted) */
+static void complete(struct ffuring *ring, uint32_t slot, int res) {
+	struct ffuring_slot *s = &ring->slots[slot];
+	if (res < 0 || (size_t) res != s->size)
+		s->batch->error = 1;
+	s->batch->pending--;
+	s->next = ring->freeslot;
+	ring->freeslot = slot;
+}
+
+/* consume the completion ring. It returns the number of completions */
+static unsigned reap(struct ffuring *ring) {
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned n = tail - head;
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		complete(ring, cqe->user_data, cqe->res);
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	ring->inflight -= n;
+	return n;
+}
+
+/* submit the queued requests (of all the batches) */
+static void submit(struct ffuring *ring) {
+	while (ring->queued > 0) {
+		int n = io_uring_enter(ring->ringfd, ring->queued, 0, 0);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			/* the kernel does not have the requests: drop them */
+			for (; ring->queued > 0; ring->queued--) {
+				unsigned tail = --*ring->sq_tail;
+				complete(ring, ring->sqes[ring->sq_array[tail & *ring->sq_mask]].user_data, -1);
+			}
+			break;
+		}
+		ring->submissions++;
+		ring->inflight += n;
+		ring->queued -= n;
+	}
+}
+
+/* wait for some completions. The ring is locked on entry and on return.
+	 While a thread waits in the kernel the others do not consume the
+	 completions: it would not wake up */
+static void wait_events(struct ffuring *ring) {
+	if (ring->waiting) {
+		pthread_cond_wait(&ring->cond, &ring->mutex);
+		return;
+	}
+	if (reap(ring) > 0) {
+		pthread_cond_broadcast(&ring->cond);
+		return;
+	}
+	if (ring->inflight == 0)
+		return;
+	ring->waiting = 1;
+	pthread_mutex_unlock(&ring->mutex);
+	io_uring_enter(ring->ringfd, 0, 1, IORING_ENTER_GETEVENTS);
+	pthread_mutex_lock(&ring->mutex);
+	ring->waiting = 0;
+	reap(ring);
+	pthread_cond_broadcast(&ring->cond);
+}
+
+/* len is the buffer length (or the number of iovecs), size the bytes to transfer */
+static void queue(struct ffuring_batch *batch, int opcode, const void *buf, size_t len,
+		off_t offset, size_t size) {
+	struct ffuring *ring = batch->ring;
+	pthread_mutex_lock(&ring->mutex);
+	while (ring->freeslot == NOSLOT) {
+		submit(ring);
+		wait_events(ring);
+	}
+	uint32_t slot = ring->freeslot;
+	ring->freeslot = ring->slots[slot].next;
+	ring->slots[slot].batch = batch;
+	ring->slots[slot].size = size;
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = ring->fd;
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = slot;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+	ring->requests++;
+	batch->pending++;
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+void ffuring_begin(struct ffuring *ring, struct ffuring_batch *batch) {
+	batch->ring = ring;
+	batch->pending = 0;
+	batch->error = 0;
+}
+
+void ffuring_read(struct ffuring_batch *batch, void *buf, size_t len, off_t offset) {
+	queue(batch, IORING_OP_READ, buf, len, offset, len);
+}
+
+void ffuring_write(struct ffuring_batch *batch, const void *buf, size_t len, off_t offset) {
+	queue(batch, IORING_OP_WRITE, buf, len, offset, len);
+}
+
+void ffuring_writev(struct ffuring_batch *batch, const struct iovec *iov, int iovcnt, off_t offset) {
+	size_t size = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+	queue(batch, IORING_OP_WRITEV, iov, iovcnt, offset, size);
+}
+
+int ffuring_end(struct ffuring_batch *batch) {
+	struct ffuring *ring = batch->ring;
+	pthread_mutex_lock(&ring->mutex);
+	submit(ring);
+	while (batch->pending > 0)
+		wait_events(ring);
+	pthread_mutex_unlock(&ring->mutex);
+	return batch->error ? -1 : 0;
+}
+
+void ffuring_stats(struct ffuring *ring, FILE *f) {
+	fprintf(f, "io_uring: %llu requests in %llu submissions\n",
+			(unsigned long long) ring->requests, (unsigned long long) ring->submissions);
+}
+
+#else
+
+struct ffuring *ffuring_new(int fd, unsigned entries) {
+	(void) fd;
+	(void) entries;
+	return NULL;
+}
+
+void ffuring_free(struct ffuring *ring) { (void) ring; }
+void ffuring_begin(struct ffuring *ring, struct ffuring_batch *batch) {
+	batch->ring = ring;
+	batch->pending = 0;
+	batch->error = 1;
+}
+void ffuring_read(struct ffuring_batch *batch, void *buf, size_t len, off_t offset) {
+	(void) batch; (void) buf; (void) len; (void) offset;
+}
+void ffuring_write(struct ffuring_batch *batch, const void *buf, size_t len, off_t offset) {
+	(void) batch; (void) buf; (void) len; (void) offset;
+}
+void ffuring_writev(struct ffuring_batch *batch, const struct iovec *iov, int iovcnt, off_t offset) {
+	(void) batch; (void) iov; (void) iovcnt; (void) offset;
+}
+int ffuring_end(struct ffuring_batch *batch) { (void) batch; return -1; }
+void ffuring_stats(struct ffuring *ring, FILE *f) { (void) ring; (void) f; }
+
+#endif
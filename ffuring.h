@@ -0,0 +1,36 @@
+#ifndef FFURING_H
+#define FFURING_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Batches of reads/writes on the image submitted through io_uring.
+	 ffuring_new returns NULL if io_uring is not available:
+	 callers must then use pread/pwrite */
+struct ffuring;
+
+/* the requests of a caller: several threads can use the same ring at once */
+struct ffuring_batch {
+	struct ffuring *ring;
+	unsigned pending; // queued or in flight
+	int error;
+};
+
+struct ffuring *ffuring_new(int fd, unsigned entries);
+void ffuring_free(struct ffuring *ring);
+
+/* ffuring_begin starts a batch. Requests are queued (and submitted when
+	 the ring is full), ffuring_end submits the queued requests and waits for
+	 the completion of all the requests of the batch. The ring is not locked
+	 while waiting. ffuring_end returns -1 if a request failed or transferred
+	 less than len bytes */
+void ffuring_begin(struct ffuring *ring, struct ffuring_batch *batch);
+void ffuring_read(struct ffuring_batch *batch, void *buf, size_t len, off_t offset);
+void ffuring_write(struct ffuring_batch *batch, const void *buf, size_t len, off_t offset);
+/* iov must not change until ffuring_end */
+void ffuring_writev(struct ffuring_batch *batch, const struct iovec *iov, int iovcnt, off_t offset);
+int ffuring_end(struct ffuring_batch *batch);
+
+void ffuring_stats(struct ffuring *ring, FILE *f);
+
+#endif
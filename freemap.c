@@ -0,0 +1,395 @@
+/**
+ * Copyright (c) 2020 Renzo Davoli <renzo@cs.unibo.it>
+ *
+ * This program  is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <ff.h>
+#include <ffcache.h>
+#include <fatcache.h>
+#include <freemap.h>
+
+/* create_chain scans the FAT entry by entry looking for a free cluster.
+	 This bitmap (one bit per cluster, set if the cluster is free) is built
+	 at mount time and it is kept up to date by watching the writes of the FAT
+	 sectors (put_fat, remove_chain). It is used to suggest where to start
+	 the search (fs->last_clst). */
+
+#define FREEMAP_SS FF_MAX_SS
+#define FREEMAP_IOSIZE (1 << 20)
+
+struct freemap {
+	BYTE fs_type;
+	LBA_t fatbase;
+	DWORD fsize;
+	DWORD n_fatent;
+	DWORD nfree;
+	uint64_t *map;
+};
+
+static inline int testbit(uint64_t *map, DWORD clst) {
+	return (map[clst / 64] >> (clst % 64)) & 1;
+}
+
+/* scan the entries of consecutive FAT sectors */
+static void freemap_scan(struct freemap *freemap, const BYTE *buff, DWORD fatsect, UINT count) {
+	DWORD perfatsect = FREEMAP_SS / (freemap->fs_type == FS_FAT32 ? 4 : 2);
+	DWORD clst = fatsect * perfatsect;
+	DWORD end = clst + count * perfatsect;
+	if (end > freemap->n_fatent)
+		end = freemap->n_fatent;
+	for (; clst < end; clst++) {
+		int isfree;
+		if (freemap->fs_type == FS_FAT32) {
+			const BYTE *p = buff + (size_t) (clst - fatsect * perfatsect) * 4;
+			isfree = ((p[0] | p[1] << 8 | p[2] << 16 | (p[3] & 0x0f) << 24) == 0);
+		} else {
+			const BYTE *p = buff + (size_t) (clst - fatsect * perfatsect) * 2;
+			isfree = ((p[0] | p[1] << 8) == 0);
+		}
+		if (clst < 2 || isfree == testbit(freemap->map, clst))
+			continue;
+		freemap->map[clst / 64] ^= 1ULL << (clst % 64);
+		if (isfree)
+			freemap->nfree++;
+		else
+			freemap->nfree--;
+	}
+}
+
+struct freemap *freemap_new(int fd, FATFS *fs, struct fatcache *fatcache, struct ffcache *cache) {
+	struct freemap *freemap;
+	BYTE *buf;
+	DWORD fatsect;
+	if (fs->fs_type != FS_FAT16 && fs->fs_type != FS_FAT32)
+		return NULL;
+	freemap = calloc(1, sizeof(*freemap));
+	buf = malloc(FREEMAP_IOSIZE);
+	if (freemap == NULL || buf == NULL)
+		goto err;
+	freemap->fs_type = fs->fs_type;
+	freemap->fatbase = fs->fatbase;
+	freemap->fsize = fs->fsize;
+	freemap->n_fatent = fs->n_fatent;
+	freemap->map = calloc((fs->n_fatent + 63) / 64, sizeof(uint64_t));
+	if (freemap->map == NULL)
+		goto err;
+	for (fatsect = 0; fatsect < fs->fsize; ) {
+		UINT count = FREEMAP_IOSIZE / FREEMAP_SS;
+		if (count > fs->fsize - fatsect)
+			count = fs->fsize - fatsect;
+		if (fatcache)
+			fatcache_read(fatcache, buf, fs->fatbase + fatsect, count);
+		else {
+			ssize_t len = (size_t) count * FREEMAP_SS;
+			if (pread(fd, buf, len, (fs->fatbase + fatsect) * FREEMAP_SS) != len)
+				goto err;
+			if (cache)
+				ffcache_overlay(cache, buf, fs->fatbase + fatsect, count);
+		}
+		freemap_scan(freemap, buf, fatsect, count);
+		fatsect += count;
+	}
+	free(buf);
+	return freemap;
+err:
+	if (freemap)
+		free(freemap->map);
+	free(freemap);
+	free(buf);
+	return NULL;
+}
+
+void freemap_free(struct freemap *freemap) {
+	free(freemap->map);
+	free(freemap);
+}
+
+void freemap_update(struct freemap *freemap, const BYTE *buff, LBA_t sector, UINT count) {
+	/* only the first FAT: the other copies have the same contents */
+	if (sector + count <= freemap->fatbase || sector >= freemap->fatbase + freemap->fsize)
+		return;
+	if (sector < freemap->fatbase) {
+		buff += (size_t) (freemap->fatbase - sector) * FREEMAP_SS;
+		count -= freemap->fatbase - sector;
+		sector = freemap->fatbase;
+	}
+	if (sector + count > freemap->fatbase + freemap->fsize)
+		count = freemap->fatbase + freemap->fsize - sector;
+	freemap_scan(freemap, buff, sector - freemap->fatbase, count);
+}
+
+/* first free cluster in [clst, end), end if none */
+static DWORD next_free(struct freemap *freemap, DWORD clst, DWORD end) {
+	while (clst < end) {
+		uint64_t word = freemap->map[clst / 64] >> (clst % 64);
+		if (word != 0) {
+			clst += __builtin_ctzll(word);
+			return clst < end ? clst : end;
+		}
+		clst = (clst / 64 + 1) * 64;
+	}
+	return end;
+}
+
+/* first allocated cluster in [clst, end), end if none */
+static DWORD next_used(struct freemap *freemap, DWORD clst, DWORD end) {
+	while (clst < end) {
+		uint64_t word = ~freemap->map[clst / 64] >> (clst % 64);
+		if (word != 0) {
+			clst += __builtin_ctzll(word);
+			return clst < end ? clst : end;
+		}
+		clst = (clst / 64 + 1) * 64;
+	}
+	return end;
+}
+
+static DWORD find_run(struct freemap *freemap, DWORD clst, DWORD end, DWORD n) {
+	while ((clst = next_free(freemap, clst, end)) < end) {
+		DWORD runend = next_used(freemap, clst, end);
+		if (runend - clst >= n)
+			return clst;
+		clst = runend;
+	}
+	return 0;
+}
+
+DWORD freemap_find(struct freemap *freemap, DWORD start, DWORD n) {
+	DWORD clst;
+	if (n == 0 || n > freemap->nfree)
+		return 0;
+	if (start < 2 || start >= freemap->n_fatent)
+		start = 2;
+	clst = find_run(freemap, start, freemap->n_fatent, n);
+	if (clst == 0 && start > 2)
+		clst = find_run(freemap, 2, start + n - 1 < freemap->n_fatent ? start + n - 1 : freemap->n_fatent, n);
+	return clst;
+}
+
+DWORD freemap_count(struct freemap *freemap) {
+	return freemap->nfree;
+}
+
+/* Counting kernels: the inner loops have a constant trip count, so that
+	 the compiler vectorizes them (SIMD compare and add) */
+#define COUNT_BLOCK 64
+
+static DWORD count_zero16(const uint16_t *entry, size_t n) {
+	DWORD count = 0;
+	size_t i = 0;
+	for (; i + COUNT_BLOCK <= n; i += COUNT_BLOCK) {
+		uint16_t blockcount = 0;
+		for (size_t j = 0; j < COUNT_BLOCK; j++)
+			blockcount += (le16toh(entry[i + j]) == 0);
+		count += blockcount;
+	}
+	for (; i < n; i++)
+		count += (le16toh(entry[i]) == 0);
+	return count;
+}
+
+static DWORD count_zero32(const uint32_t *entry, size_t n) {
+	DWORD count = 0;
+	size_t i = 0;
+	for (; i + COUNT_BLOCK <= n; i += COUNT_BLOCK) {
+		uint32_t blockcount = 0;
+		for (size_t j = 0; j < COUNT_BLOCK; j++)
+			blockcount += ((le32toh(entry[i + j]) & 0x0FFFFFFF) == 0);
+		count += blockcount;
+	}
+	for (; i < n; i++)
+		count += ((le32toh(entry[i]) & 0x0FFFFFFF) == 0);
+	return count;
+}
+
+static DWORD count_set(const uint64_t *word, size_t n) {
+	DWORD count = 0;
+	for (size_t i = 0; i < n; i++)
+		count += __builtin_popcountll(word[i]);
+	return count;
+}
+
+/* Incremental count of the free clusters of a FAT16/32 or exFAT volume:
+	 the FAT (or the allocation bitmap) is read one chunk at a time.
+	 The writes of the sectors already counted update the partial count
+	 (freecount_update), so the count is exact when the scan reaches the end. */
+struct freecount {
+	int fd;
+	FATFS *fs;
+	struct fatcache *fatcache;
+	struct ffcache *cache;
+	LBA_t base; // first sector of the FAT or of the bitmap
+	LBA_t next; // next sector to count
+	LBA_t end;
+	uint64_t nitems; // FAT entries or bitmap bits
+	UINT perfatsect;
+	DWORD nfree; // free clusters in [base, next)
+	uint64_t *buf;
+};
+
+struct freecount *freecount_new(int fd, FATFS *fs, struct fatcache *fatcache, struct ffcache *cache) {
+	struct freecount *fc;
+	LBA_t base;
+	uint64_t nitems;
+	UINT perfatsect;
+	switch (fs->fs_type) {
+		case FS_FAT16: base = fs->fatbase; nitems = fs->n_fatent; perfatsect = FREEMAP_SS / 2; break;
+		case FS_FAT32: base = fs->fatbase; nitems = fs->n_fatent; perfatsect = FREEMAP_SS / 4; break;
+#if FF_FS_EXFAT
+		case FS_EXFAT: base = fs->bitbase; nitems = fs->n_fatent - 2; perfatsect = FREEMAP_SS * 8; break;
+#endif
+		default: return NULL;
+	}
+	fc = malloc(sizeof(*fc));
+	if (fc == NULL)
+		return NULL;
+	fc->buf = malloc(FREEMAP_IOSIZE);
+	if (fc->buf == NULL) {
+		free(fc);
+		return NULL;
+	}
+	fc->fd = fd;
+	fc->fs = fs;
+	fc->fatcache = fatcache;
+	fc->cache = cache;
+	fc->base = fc->next = base;
+	fc->end = base + (nitems + perfatsect - 1) / perfatsect;
+	fc->nitems = nitems;
+	fc->perfatsect = perfatsect;
+	fc->nfree = 0;
+	return fc;
+}
+
+void freecount_free(struct freecount *fc) {
+	free(fc->buf);
+	free(fc);
+}
+
+/* read count sectors as they appear on the disk: including the sectors
+	 waiting in the caches (but not the dirty FatFs window) */
+static int read_sectors(struct freecount *fc, BYTE *buf, LBA_t sector, UINT count) {
+	if (fc->fatcache == NULL || fatcache_read(fc->fatcache, buf, sector, count) <= 0) {
+		ssize_t len = (size_t) count * FREEMAP_SS;
+		if (pread(fc->fd, buf, len, sector * FREEMAP_SS) != len)
+			return -1;
+		if (fc->cache)
+			ffcache_overlay(fc->cache, buf, sector, count);
+	}
+	return 0;
+}
+
+/* number of free clusters described by count sectors starting from sector */
+static DWORD count_free(struct freecount *fc, const BYTE *buf, LBA_t sector, UINT count) {
+	uint64_t first = (sector - fc->base) * fc->perfatsect;
+	uint64_t n = (uint64_t) count * fc->perfatsect;
+	if (first >= fc->nitems)
+		return 0;
+	if (n > fc->nitems - first)
+		n = fc->nitems - first;
+	switch (fc->fs->fs_type) {
+		case FS_FAT16: return count_zero16((const uint16_t *) buf, n);
+		case FS_FAT32: return count_zero32((const uint32_t *) buf, n);
+		default: { // exFAT: bits set are clusters in use
+							 const uint64_t *word = (const uint64_t *) buf;
+							 size_t nwords = n / 64;
+							 DWORD used = count_set(word, nwords);
+							 if (n % 64)
+								 used += __builtin_popcountll(le64toh(word[nwords]) & ((1ULL << (n % 64)) - 1));
+							 return n - used;
+						 }
+	}
+}
+
+int freecount_step(struct freecount *fc) {
+	UINT count = FREEMAP_IOSIZE / FREEMAP_SS;
+	if (fc->next >= fc->end)
+		return 1;
+	if (count > fc->end - fc->next)
+		count = fc->end - fc->next;
+	if (read_sectors(fc, (BYTE *) fc->buf, fc->next, count) < 0)
+		return -1;
+	fc->nfree += count_free(fc, (BYTE *) fc->buf, fc->next, count);
+	fc->next += count;
+	return fc->next >= fc->end;
+}
+
+/* replace the contribution of the sectors already counted: the previous
+	 contents are read before the new ones reach the caches or the disk */
+static int recount(struct freecount *fc, const BYTE *buff, LBA_t sector, UINT count) {
+	while (count > 0) {
+		UINT chunk = FREEMAP_IOSIZE / FREEMAP_SS;
+		if (chunk > count)
+			chunk = count;
+		if (read_sectors(fc, (BYTE *) fc->buf, sector, chunk) < 0)
+			return -1;
+		fc->nfree -= count_free(fc, (BYTE *) fc->buf, sector, chunk);
+		fc->nfree += count_free(fc, buff, sector, chunk);
+		buff += (size_t) chunk * FREEMAP_SS;
+		sector += chunk;
+		count -= chunk;
+	}
+	return 0;
+}
+
+/* in case of I/O error the count restarts from the beginning */
+static void restart(struct freecount *fc) {
+	fc->next = fc->base;
+	fc->nfree = 0;
+}
+
+void freecount_update(struct freecount *fc, const BYTE *buff, LBA_t sector, UINT count) {
+	if (sector + count <= fc->base || sector >= fc->next)
+		return;
+	if (sector < fc->base) {
+		buff += (size_t) (fc->base - sector) * FREEMAP_SS;
+		count -= fc->base - sector;
+		sector = fc->base;
+	}
+	if (sector + count > fc->next)
+		count = fc->next - sector;
+	if (recount(fc, buff, sector, count) < 0)
+		restart(fc);
+}
+
+DWORD freecount_estimate(struct freecount *fc) {
+	uint64_t scanned = (fc->next - fc->base) * fc->perfatsect;
+	uint64_t total = fc->fs->n_fatent - 2;
+	uint64_t estimate;
+	if (scanned == 0)
+		return 0;
+	if (scanned > fc->nitems)
+		scanned = fc->nitems;
+	estimate = (uint64_t) fc->nfree * fc->nitems / scanned;
+	return estimate < total ? estimate : total;
+}
+
+DWORD freecount_result(struct freecount *fc) {
+	FATFS *fs = fc->fs;
+	if (fc->next < fc->end)
+		return 0xFFFFFFFF;
+	/* the dirty FatFs window has not been written yet */
+	if (fs->wflag && fs->winsect >= fc->base && fs->winsect < fc->end)
+		if (recount(fc, fs->win, fs->winsect, 1) < 0) {
+			restart(fc);
+			return 0xFFFFFFFF;
+		}
+	return fc->nfree;
+}
@@ -0,0 +1,47 @@
+#ifndef FREEMAP_H
+#define FREEMAP_H
+#include <stdint.h>
+#include <ff.h>
+
+/* In-memory bitmap of the free clusters of a FAT16/32 volume */
+struct freemap;
+
+struct ffcache;
+struct fatcache;
+/* build the bitmap from the FAT (taken from fatcache or cache if available) */
+struct freemap *freemap_new(int fd, FATFS *fs, struct fatcache *fatcache, struct ffcache *cache);
+void freemap_free(struct freemap *freemap);
+
+/* update the bitmap when FAT sectors are written */
+void freemap_update(struct freemap *freemap, const BYTE *buff, LBA_t sector, UINT count);
+
+/* return the first cluster of a run of n free clusters starting from start
+	 (wrapping around at the end of the volume), 0 if no such run exists */
+DWORD freemap_find(struct freemap *freemap, DWORD start, DWORD n);
+
+/* number of free clusters */
+DWORD freemap_count(struct freemap *freemap);
+
+/* Incremental count of the free clusters of a FAT16/32 or exFAT volume.
+	 All the functions must be called holding the lock of the volume */
+struct freecount;
+
+/* NULL if the volume is FAT12 */
+struct freecount *freecount_new(int fd, FATFS *fs, struct fatcache *fatcache, struct ffcache *cache);
+void freecount_free(struct freecount *fc);
+
+/* count the next chunk: it returns 1 when the count is complete,
+	 0 if there are more chunks to count, -1 in case of I/O error */
+int freecount_step(struct freecount *fc);
+
+/* to be called before the sectors reach the caches or the disk */
+void freecount_update(struct freecount *fc, const BYTE *buff, LBA_t sector, UINT count);
+
+/* estimate of the free clusters based on the chunks counted so far */
+DWORD freecount_estimate(struct freecount *fc);
+
+/* the free clusters when the count is complete, 0xFFFFFFFF otherwise
+	 (if an I/O error occurred the count restarts) */
+DWORD freecount_result(struct freecount *fc);
+
+#endif
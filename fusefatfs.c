@@ -27,14 +27,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <fuse.h>
 #include <time.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include <ff.h>
+#include <diskio.h>
 #include <fftable.h>
+#include <ffcache.h>
+#include <fatcache.h>
+#include <freemap.h>
+#include <ffuring.h>
+#include <pathcache.h>
 #include <config.h>
 
 int fuse_reentrant_tag = 0;
@@ -48,11 +59,25 @@ int fuse_reentrant_tag = 0;
 #endif
 
 #define FAT_DEFAULT_CODEPAGE 850
+#define FAT_DEFAULT_CACHESIZE 4 // MiB
+#define FAT_DEFAULT_FATCACHEMAX 64 // MiB
+#define FAT_DEFAULT_FLUSHTIME 5 // seconds
+#define FAT_DEFAULT_PATHCACHE 4096 // entries
+/* kernel caching of entries and attributes (seconds) */
+#define FAT_RW_TIMEOUT 1.0
+#define FAT_RO_TIMEOUT 3600.0 // the image does not change
+#define FAT_RW_TIMEOUT_STR "1"
+#define FAT_RO_TIMEOUT_STR "3600"
+#define FUSE_DEFAULT_TIMEOUT 1.0 // entry_timeout and attr_timeout of libfuse
 
+/* volume control functions (f_mount) are not re-entrant */
 static pthread_mutex_t fff_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define mutex_in() pthread_mutex_lock(&fff_mutex)
-#define mutex_out() pthread_mutex_unlock(&fff_mutex)
-#define mutex_out_return(RETVAL) do {mutex_out(); return(RETVAL); } while (0)
+
+/* FatFs locks the volume in each call (FF_FS_REENTRANT). The same
+	 (recursive) mutex protects sequences of calls and fusefatfs' own state */
+#define mutex_in(ffentry) ff_mutex_take((ffentry)->index)
+#define mutex_out(ffentry) ff_mutex_give((ffentry)->index)
+#define mutex_out_return(ffentry, RETVAL) do {mutex_out(ffentry); return(RETVAL); } while (0)
 
 #define fffpath(index, path) \
   *fffpath; \
@@ -64,6 +89,66 @@ static pthread_mutex_t fff_mutex = PTHREAD_MUTEX_INITIALIZER;
   } else \
     fffpath = path
 
+/* open files. The operations on open files get no path from FUSE
+	 (nullpath_ok): the file keeps it. The open files of rw volumes are
+	 listed and all the handles of a file share the same FIL (size, cluster
+	 chain, link map): the directory entry of the writable ones is written
+	 back on flush, fsync and release only (see fff_syncfile).
+	 The FIL has FA_WRITE while some handle is open for writing */
+struct fffile {
+	FIL fil;
+	struct fffile *next;
+	char *path;
+	int count; // open handles
+	int writers; // handles open for writing
+};
+
+/* open handle */
+struct fffhandle {
+	struct fffile *file;
+	BYTE mode; // FA_READ, FA_WRITE
+	/* readahead: expected offset of the next sequential read,
+		 end of the range already requested, current window */
+	FSIZE_t ra_next;
+	FSIZE_t ra_end;
+	FSIZE_t ra_window;
+};
+
+#define fi2handle(fi) ((struct fffhandle *) (uintptr_t) (fi)->fh)
+#define fi2file(fi) (fi2handle(fi)->file)
+#define fi2fil(fi) (&fi2file(fi)->fil)
+/* the volume (lane) of an open file */
+#define fil2fftab(fp) fftab_get((fp)->obj.fs->ldrv)
+
+/* initial size (in DWORDs) of the cluster link map table: up to 15 fragments */
+#define FFF_CLTBL_INIT 32
+
+/* fallocate: chunk of zeros written to the preallocated range */
+#define FFF_ZEROBUF (1 << 20)
+
+/* readahead window: it doubles at each sequential read up to the max */
+#define FFF_RA_MIN (128 << 10)
+#define FFF_RA_MAX (4 << 20)
+
+/* lock the volume. Read-only volumes can be mounted several times
+	 (-o readers=N): each lane has its own FatFs state (window, open objects),
+	 so requests on different lanes run in parallel */
+static struct fftab *fff_lane_in(struct fftab *ffentry) {
+	int k, first;
+	if (ffentry->nlanes <= 1) {
+		mutex_in(ffentry);
+		return ffentry;
+	}
+	first = __atomic_fetch_add(&ffentry->nextlane, 1, __ATOMIC_RELAXED) % ffentry->nlanes;
+	for (k = 0; k < ffentry->nlanes; k++) {
+		struct fftab *lane = ffentry->lane[(first + k) % ffentry->nlanes];
+		if (ff_mutex_trytake(lane->index))
+			return lane;
+	}
+	mutex_in(ffentry->lane[first]);
+	return ffentry->lane[first];
+}
+
 static int fr2errno(FRESULT fres) {
 	switch (fres) {
 		case FR_OK: return 0;
@@ -86,14 +171,66 @@ static int fr2errno(FRESULT fres) {
 	}
 }
 
+/* fast seek: build the cluster link map table of an open file.
+	 The table is sized from the number of fragments of the file:
+	 when the initial guess is too small, f_lseek returns the required size */
+static void fff_linkmap(FIL *fp) {
+	DWORD tlen = FFF_CLTBL_INIT;
+	DWORD *cltbl = NULL;
+	for (;;) {
+		DWORD *newtbl = realloc(cltbl, tlen * sizeof(DWORD));
+		if (newtbl == NULL)
+			break;
+		cltbl = newtbl;
+		cltbl[0] = tlen;
+		fp->cltbl = cltbl;
+		FRESULT fres = f_lseek(fp, CREATE_LINKMAP);
+		if (fres == FR_OK)
+			return;
+		fp->cltbl = NULL;
+		if (fres != FR_NOT_ENOUGH_CORE)
+			break;
+		tlen = cltbl[0];
+	}
+	free(cltbl);
+}
+
+/* the cluster link map table cannot follow changes of the cluster chain.
+	 It belongs to the FIL shared by all the handles of the file (rw volumes):
+	 each write beyond the end of file, truncate or fallocate drops it for all
+	 of them, the next read builds it again */
+static void fff_droplinkmap(FIL *fp) {
+	free(fp->cltbl);
+	fp->cltbl = NULL;
+}
+
+/* create_chain (and f_expand) look for free clusters starting from
+	 fs->last_clst + 1: let them start from a run of n free clusters */
+static void fff_allochint(struct fftab *ffentry, DWORD n) {
+	if (ffentry->freemap) {
+		FATFS *fs = &ffentry->fs;
+		DWORD clst = freemap_find(ffentry->freemap, fs->last_clst + 1, n);
+		if (clst >= 2)
+			fs->last_clst = clst - 1;
+	}
+}
+
+/* the number of clusters to be allocated to extend the file of fp to size
+	 (the last cluster of the file may have room) */
+static DWORD fff_newclusters(FIL *fp, FSIZE_t size) {
+	FSIZE_t clustsize = (FSIZE_t) fp->obj.fs->csize * FF_MAX_SS;
+	FSIZE_t alloc = (f_size(fp) + clustsize - 1) / clustsize * clustsize;
+	return size > alloc ? (size - alloc + clustsize - 1) / clustsize : 0;
+}
+
+/* O_TRUNC is not converted (FA_CREATE_ALWAYS): the file may be already open,
+	 fff_getfile truncates the shared FIL */
 static BYTE flags2ffmode(int flags) {
 	// O_RDONLY -> FA_READ, O_WRONLY -> FA_WRITE, O_RDWR -> FA_READ | FA_WRITE
 	BYTE ffmode = ((flags & O_ACCMODE) + 1) & O_ACCMODE;
 	if (flags & O_CREAT) {
 		if (flags & O_EXCL)
 			ffmode |= FA_CREATE_NEW;
-		else if (flags & O_TRUNC)
-			ffmode |= FA_CREATE_ALWAYS;
 		else
 			ffmode |= FA_OPEN_ALWAYS;
 	}
@@ -121,261 +258,980 @@ static time_t fftime2time(WORD fdate, WORD ftime) {
 	}
 }
 
+/* the open file of the directory entry of fp (rw volumes) */
+static struct fffile *fff_samefile(struct fftab *ffentry, FIL *fp) {
+	struct fffile *file;
+	for (file = ffentry->files; file != NULL; file = file->next) {
+		if (file->fil.dir_sect != fp->dir_sect || file->fil.dir_ptr != fp->dir_ptr)
+			continue;
+#if FF_FS_EXFAT
+		/* (c_scl and c_ofs are set on exFAT volumes only) */
+		if (fp->obj.fs->fs_type == FS_EXFAT &&
+				(file->fil.obj.c_scl != fp->obj.c_scl || file->fil.obj.c_ofs != fp->obj.c_ofs))
+			continue;
+#endif
+		break;
+	}
+	return file;
+}
+
+/* the open file of path, NULL if path is not open */
+static struct fffile *fff_findfile(struct fftab *ffentry, const char *path) {
+	struct fffile *file = NULL;
+	if (ffentry->files != NULL) {
+		const char fffpath(ffentry->index, path);
+		FIL fp;
+		if (f_open(&fp, fffpath, FA_READ) == FR_OK) {
+			file = fff_samefile(ffentry, &fp);
+			f_close(&fp);
+		}
+	}
+	return file;
+}
+
+/* close a handle of file (mode: its FA_READ, FA_WRITE): the FIL is closed
+	 by the last one. When the last writer goes, the FIL is synced and loses
+	 FA_WRITE: the remaining handles are read-only */
+static FRESULT fff_putfile(struct fftab *ffentry, struct fffile *file, BYTE mode) {
+	struct fffile **scan;
+	FRESULT fres = FR_OK;
+	if ((mode & FA_WRITE) && --file->writers == 0 && file->count > 1) {
+		fres = f_sync(&file->fil);
+		file->fil.flag &= ~FA_WRITE;
+	}
+	if (--file->count > 0)
+		return fres;
+	for (scan = &ffentry->files; *scan != NULL; scan = &(*scan)->next) {
+		if (*scan == file) {
+			*scan = file->next;
+			break;
+		}
+	}
+	fres = f_close(&file->fil);
+	fff_droplinkmap(&file->fil);
+	free(file->path);
+	free(file);
+	return fres;
+}
+
+/* open path: the handles of a file opened more than once get the same FIL.
+	 (read-only volumes: each lane has its own FatFs state, FILs are not shared) */
+static FRESULT fff_getfile(struct fftab *ffentry, const char *path, int flags,
+		struct fffile **filep) {
+	const char fffpath(ffentry->index, path);
+	struct fffile *file = malloc(sizeof(*file));
+	struct fffile *open;
+	FRESULT fres;
+	if (file == NULL)
+		return FR_NOT_ENOUGH_CORE;
+	if ((fres = f_open(&file->fil, fffpath, flags2ffmode(flags))) != FR_OK) {
+		free(file);
+		return fres;
+	}
+	if (!(ffentry->flags & FFFF_RDONLY) && (open = fff_samefile(ffentry, &file->fil)) != NULL) {
+		/* the new FIL has not been modified: it refers to an existing file */
+		f_close(&file->fil);
+		free(file);
+		file = open;
+		/* the FIL serves all the handles: FA_READ is never dropped, the kernel
+			 checks the access mode of each descriptor */
+		file->fil.flag |= flags2ffmode(flags) & (FA_READ | FA_WRITE);
+	} else if ((file->path = strdup(path)) == NULL) {
+		f_close(&file->fil);
+		free(file);
+		return FR_NOT_ENOUGH_CORE;
+	} else {
+		file->count = file->writers = 0;
+		if (!(ffentry->flags & FFFF_RDONLY)) {
+			file->next = ffentry->files;
+			ffentry->files = file;
+		}
+	}
+	file->count++;
+	if (flags2ffmode(flags) & FA_WRITE)
+		file->writers++;
+	if ((flags & O_TRUNC) && (file->fil.flag & FA_WRITE) && f_size(&file->fil) > 0) {
+		fff_droplinkmap(&file->fil);
+		fres = f_lseek(&file->fil, 0);
+		if (fres == FR_OK)
+			fres = f_truncate(&file->fil);
+		if (fres != FR_OK) {
+			fff_putfile(ffentry, file, flags2ffmode(flags));
+			return fres;
+		}
+	}
+	*filep = file;
+	return FR_OK;
+}
+
+/* rename moved the directory entry of an open file to newpath */
+static void fff_movefile(struct fftab *ffentry, struct fffile *file, const char *newpath) {
+	const char fffpath(ffentry->index, newpath);
+	FIL fp;
+	if (f_open(&fp, fffpath, FA_READ) == FR_OK) {
+		file->fil.dir_sect = fp.dir_sect;
+		file->fil.dir_ptr = fp.dir_ptr;
+#if FF_FS_EXFAT
+		file->fil.obj.c_scl = fp.obj.c_scl;
+		file->fil.obj.c_size = fp.obj.c_size;
+		file->fil.obj.c_ofs = fp.obj.c_ofs;
+#endif
+		f_close(&fp);
+	}
+}
+
+/* update the directory entry of an open file being written, so that
+	 lookups see its size and time (f_sync does nothing if the file has not
+	 been modified). The caches are not written back (no CTRL_SYNC) */
+static void fff_syncfile(struct fftab *ffentry, struct fffile *file) {
+	if (file->fil.flag & FA_WRITE) {
+		ffentry->nosync = 1;
+		f_sync(&file->fil);
+		ffentry->nosync = 0;
+	}
+}
+
+/* the same for all the open files: before reading a whole directory */
+static void fff_syncfiles(struct fftab *ffentry) {
+	struct fffile *file;
+	for (file = ffentry->files; file != NULL; file = file->next)
+		fff_syncfile(ffentry, file);
+}
+
+/* the open file of path, NULL if path is not open. No lookup: the paths of
+	 the open files are compared (short name aliases are not recognized) */
+static struct fffile *fff_pathfile(struct fftab *ffentry, const char *path) {
+	struct fffile *file;
+	for (file = ffentry->files; file != NULL; file = file->next)
+		if (pathcache_samepath(file->path, path))
+			break;
+	return file;
+}
+
+/* the attributes of path changed (removed: path has been renamed or removed).
+	 The parent directory is dropped too (exFAT directories have a size) and
+	 so are the negative entries of the parent: a new name may match them */
+static void fff_pathchanged(struct fftab *ffentry, const char *path, int removed) {
+	if (ffentry->pathcache == NULL || path == NULL)
+		return;
+	if (removed)
+		pathcache_delprefix(ffentry->pathcache, path);
+	else
+		pathcache_del(ffentry->pathcache, path);
+	char *slash = strrchr(path, '/');
+	if (slash != NULL && slash != path) {
+		char parent[slash - path + 1];
+		snprintf(parent, sizeof(parent), "%s", path);
+		pathcache_del(ffentry->pathcache, parent);
+		pathcache_delnegative(ffentry->pathcache, parent);
+	} else
+		pathcache_delnegative(ffentry->pathcache, "");
+}
+
+static void fff_fillstat(const FILINFO *fileinfo, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_size = fileinfo->fsize;
+	stbuf->st_ctime = stbuf->st_mtime =
+		fftime2time(fileinfo->fdate, fileinfo->ftime);
+	if (fileinfo->fattrib & AM_DIR) {
+		stbuf->st_mode = 0755 | S_IFDIR;
+		stbuf->st_nlink = 2;
+	} else {
+		stbuf->st_nlink = 1;
+		stbuf->st_mode = 0755 | S_IFREG;
+	}
+	if (fileinfo->fattrib & AM_RDO)
+		stbuf->st_mode &= ~0222;
+}
+
+/* inode numbers (use_ino): the location of the directory entry, i.e. the
+	 start cluster of the directory and the index of the entry in it (the last
+	 entry of the set of a long name). They do not change across remounts,
+	 but rename moves the entry. dp: f_readdir has just returned the entry,
+	 dp points to the following one (unless the end of the directory has been
+	 reached: dir_next leaves dptr unchanged and clears sect) */
+#define FFF_ROOT_INO 1
+#define FFF_DIRENTSIZE 32
+#define FFF_DIRINDEX_BITS 23 // up to 256MiB (exFAT)
+static ino_t fff_ino(DIR *dp) {
+	DWORD dptr = dp->sect == 0 ? dp->dptr : dp->dptr - FFF_DIRENTSIZE;
+	return (((ino_t) dp->obj.sclust << FFF_DIRINDEX_BITS) | (dptr / FFF_DIRENTSIZE)) +
+		FFF_ROOT_INO + 1;
+}
+
+/* f_stat does not tell where the entry is: look up the last name of path
+	 (case folded, long or short name) in a single scan of its directory,
+	 which returns both the entry and its inode number */
+static FRESULT fff_stat(struct fftab *ffentry, const char *path, FILINFO *fileinfo, ino_t *ino) {
+	const char *slash = strrchr(path, '/');
+	char dir[slash - path + 2];
+	snprintf(dir, slash == path ? 2 : (size_t) (slash - path + 1), "%s", path);
+	const char fffpath(ffentry->index, dir);
+	DIR dp;
+	FRESULT fres = f_opendir(&dp, fffpath);
+	*ino = 0;
+	if (fres != FR_OK)
+		return fres == FR_NO_FILE ? FR_NO_PATH : fres;
+	while ((fres = f_readdir(&dp, fileinfo)) == FR_OK && fileinfo->fname[0] != 0) {
+		if (pathcache_samepath(fileinfo->fname, slash + 1) ||
+				(fileinfo->altname[0] != 0 && pathcache_samepath(fileinfo->altname, slash + 1))) {
+			*ino = fff_ino(&dp);
+			break;
+		}
+	}
+	f_closedir(&dp);
+	if (fres == FR_OK && fileinfo->fname[0] == 0)
+		fres = FR_NO_FILE;
+	return fres;
+}
+
+/* read the whole directory of path into the directory index of the path cache */
+static void fff_indexdir(struct fftab *ffentry, const char *path) {
+	const char *slash = strrchr(path, '/');
+	char dir[slash - path + 2];
+	snprintf(dir, slash == path ? 2 : (size_t) (slash - path + 1), "%s", path);
+	const char fffpath(ffentry->index, dir);
+	struct pathcache_dir *d = pathcache_dirbegin(ffentry->pathcache, dir);
+	DIR dp;
+	FILINFO fileinfo;
+	struct stat st;
+	FRESULT fres;
+	if (d == NULL)
+		return;
+	if ((fres = f_opendir(&dp, fffpath)) != FR_OK) {
+		pathcache_dirabort(d);
+		return;
+	}
+	while ((fres = f_readdir(&dp, &fileinfo)) == FR_OK && fileinfo.fname[0] != 0) {
+		fff_fillstat(&fileinfo, &st);
+		st.st_ino = fff_ino(&dp);
+		pathcache_diradd(d, fileinfo.fname, fileinfo.altname, &st);
+	}
+	f_closedir(&dp);
+	if (fres == FR_OK)
+		pathcache_dirend(ffentry->pathcache, d);
+	else
+		pathcache_dirabort(d);
+}
+
 static int fff_getattr(const char *path, struct stat *stbuf FUSE3_ONLY(, struct fuse_file_info *fi))
 {
-	FUSE3_ONLY((void) fi);
-	mutex_in();
+#if FUSE != 2
+	/* fstat: rename changes the path of the open file (under the lock) */
+	if (path == NULL) {
+		struct fftab *ffentry = fil2fftab(fi2fil(fi));
+		mutex_in(ffentry);
+		char *filepath = strdup(fi2file(fi)->path);
+		mutex_out(ffentry);
+		if (filepath == NULL)
+			return -ENOMEM;
+		int rv = fff_getattr(filepath, stbuf, NULL);
+		free(filepath);
+		return rv;
+	}
+#endif
 	struct fuse_context *cntx=fuse_get_context();
 	struct fftab *ffentry = cntx->private_data;
+	if (ffentry->pathcache) {
+		switch (pathcache_get(ffentry->pathcache, path, stbuf)) {
+			case 1: return 0;
+			case -1: return -ENOENT;
+		}
+	}
+	ffentry = fff_lane_in(ffentry);
 	FRESULT fres;
 	// f_stat path: The object must not be the root directory */
 	if (strcmp(path, "/") == 0) {
 		memset(stbuf, 0, sizeof(struct stat));
 		stbuf->st_mode = 0755 | S_IFDIR;
 		stbuf->st_nlink = 2;
-		mutex_out_return(0);
+		stbuf->st_ino = FFF_ROOT_INO;
+		mutex_out_return(ffentry, 0);
 	} else {
-		const char fffpath(ffentry->index, path);
 		FILINFO fileinfo;
-		fres = f_stat(fffpath, &fileinfo);
-		//printf("getattr %s %s -> %d\n", path, fffpath, fres);
-		if (fres != FR_OK) goto err;
-		memset(stbuf, 0, sizeof(struct stat));
-		stbuf->st_size = fileinfo.fsize;
-		stbuf->st_ctime = stbuf->st_mtime =
-			fftime2time(fileinfo.fdate, fileinfo.ftime);
-		if (fileinfo.fattrib & AM_DIR) {
-			stbuf->st_mode = 0755 | S_IFDIR;
-			stbuf->st_nlink = 2;
-		} else {
-			stbuf->st_nlink = 1;
-			stbuf->st_mode = 0755 | S_IFREG;
+		ino_t ino = 0;
+		struct fffile *file;
+		/* a directory is read once, then its names are looked up in memory */
+		if (ffentry->pathcache && pathcache_needindex(ffentry->pathcache, path)) {
+			fff_syncfiles(ffentry);
+			fff_indexdir(ffentry, path);
+			switch (pathcache_get(ffentry->pathcache, path, stbuf)) {
+				case 1: mutex_out_return(ffentry, 0);
+				case -1: mutex_out_return(ffentry, -ENOENT);
+			}
 		}
-		if (fileinfo.fattrib & AM_RDO)
-			stbuf->st_mode &= ~0222;
+		if ((file = fff_pathfile(ffentry, path)) != NULL)
+			fff_syncfile(ffentry, file);
+		fres = fff_stat(ffentry, path, &fileinfo, &ino);
+		//printf("getattr %s -> %d\n", path, fres);
+		if (fres == FR_NO_FILE && ffentry->pathcache)
+			pathcache_putnegative(ffentry->pathcache, path);
+		if (fres != FR_OK) goto err;
+		fff_fillstat(&fileinfo, stbuf);
+		stbuf->st_ino = ino;
+		if (ffentry->pathcache)
+			pathcache_put(ffentry->pathcache, path, stbuf);
 	}
-	mutex_out_return(0);
+	mutex_out_return(ffentry, 0);
 err:
-	mutex_out_return(fr2errno(fres));
+	mutex_out_return(ffentry, fr2errno(fres));
+}
+
+/* a new handle of path */
+static int fff_openhandle(struct fftab *ffentry, const char *path, int flags,
+		struct fuse_file_info *fi) {
+	struct fffhandle *handle = calloc(1, sizeof(*handle));
+	if (handle == NULL)
+		return -ENOMEM;
+	FRESULT fres = fff_getfile(ffentry, path, flags, &handle->file);
+	if (fres != FR_OK) {
+		free(handle);
+		return fr2errno(fres);
+	}
+	handle->mode = flags2ffmode(flags) & (FA_READ | FA_WRITE);
+	fi->fh = (uintptr_t) handle;
+	return 0;
 }
 
 static int fff_open(const char *path, struct fuse_file_info *fi){
-	mutex_in();
 	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
+	struct fftab *ffentry = fff_lane_in(cntx->private_data);
 	if ((ffentry->flags & FFFF_RDONLY) && (fi->flags & O_ACCMODE) != O_RDONLY)
-		mutex_out_return(-EROFS);
-	FIL fp;
-	FRESULT fres = f_open(&fp, fffpath, flags2ffmode(fi->flags));
-	if (fres == FR_OK)
-		f_close(&fp);
-	mutex_out_return(fr2errno(fres));
+		mutex_out_return(ffentry, -EROFS);
+	int rv = fff_openhandle(ffentry, path, fi->flags, fi);
+	if (rv == 0 && (fi->flags & O_ACCMODE) != O_RDONLY)
+		fff_pathchanged(ffentry, path, 0);
+	mutex_out_return(ffentry, rv);
 }
 
 static int fff_create(const char *path, mode_t mode, struct fuse_file_info *fi){
-	(void) fi;
 	(void) mode; // XXX set readonly?
-	mutex_in();
 	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
+	struct fftab *ffentry = fff_lane_in(cntx->private_data);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	FIL fp;
-	FRESULT fres = f_open(&fp, fffpath, flags2ffmode(fi->flags | O_CREAT));
-	if (fres == FR_OK)
-		f_close(&fp);
-	mutex_out_return(fr2errno(fres));
+		mutex_out_return(ffentry, -EROFS);
+	fff_allochint(ffentry, 1);
+	int rv = fff_openhandle(ffentry, path, fi->flags | O_CREAT, fi);
+	fff_pathchanged(ffentry, path, 0);
+	mutex_out_return(ffentry, rv);
 }
 
 static int fff_release(const char *path, struct fuse_file_info *fi){
 	(void) path;
-	(void) fi;
-	return 0;
+	struct fffhandle *handle = fi2handle(fi);
+	struct fftab *ffentry = fil2fftab(&handle->file->fil);
+	mutex_in(ffentry);
+	FRESULT fres = fff_putfile(ffentry, handle->file, handle->mode);
+	free(handle);
+	mutex_out_return(ffentry, fr2errno(fres));
+}
+
+/* the run of contiguous sectors of the file starting at pos: it returns
+	 its length (at most maxlen) and its position in the image, 0 in case of error */
+static FSIZE_t fff_extent(FIL *fp, FSIZE_t pos, FSIZE_t maxlen, off_t *diskpos) {
+	FATFS *fs = fp->obj.fs;
+	FSIZE_t clustsize = (FSIZE_t) fs->csize * FF_MAX_SS;
+	DWORD cl = pos / clustsize; // cluster index in the file
+	DWORD clst, ncl;
+	if (fp->cltbl) {
+		DWORD *tbl = fp->cltbl + 1;
+		for (;;) {
+			ncl = *tbl++;
+			if (ncl == 0)
+				return 0;
+			if (cl < ncl)
+				break;
+			cl -= ncl;
+			tbl++;
+		}
+		clst = *tbl + cl;
+		ncl -= cl;
+	} else { // the file is in its first cluster
+		clst = fp->obj.sclust;
+		ncl = 1;
+	}
+	FSIZE_t len = ncl * clustsize - pos % clustsize;
+	*diskpos = ((off_t) fs->database + (off_t) (clst - 2) * fs->csize) * FF_MAX_SS +
+		pos % clustsize;
+	return len < maxlen ? len : maxlen;
+}
+
+/* read-only volumes: the cluster chain of a file never changes.
+	 The lock is needed to build the cluster link map only, the data sectors
+	 are read without it (fp->cltbl and the file size are not modified) */
+static int fff_read_unlocked(struct fftab *ffentry, FIL *fp, char *buf, size_t size, off_t offset) {
+	size_t done;
+	FSIZE_t len;
+	off_t diskpos;
+	if ((FSIZE_t) offset >= f_size(fp))
+		return 0;
+	if (size > f_size(fp) - offset)
+		size = f_size(fp) - offset;
+	if (ffentry->map) {
+		for (done = 0; done < size; done += len) {
+			if ((len = fff_extent(fp, offset + done, size - done, &diskpos)) == 0 ||
+					diskpos + len > ffentry->mapsize)
+				return -EIO;
+			memcpy(buf + done, ffentry->map + diskpos, len);
+		}
+		return done;
+	}
+	if (ffentry->uring) {
+		/* all the fragments in a single submission */
+		struct ffuring_batch batch;
+		ffuring_begin(ffentry->uring, &batch);
+		for (done = 0; done < size; done += len) {
+			if ((len = fff_extent(fp, offset + done, size - done, &diskpos)) == 0)
+				break;
+			ffuring_read(&batch, buf + done, len, diskpos);
+		}
+		if (ffuring_end(&batch) == 0 && done == size)
+			return size;
+	}
+	for (done = 0; done < size; done += len) {
+		if ((len = fff_extent(fp, offset + done, size - done, &diskpos)) == 0)
+			return -EIO;
+		ssize_t n = pread(ffentry->fd, buf + done, len, diskpos);
+		if (n <= 0)
+			return -EIO;
+		len = n;
+	}
+	return done;
+}
+
+/* build the cluster link map if needed. It returns 1 if the data of
+	 the file can be read without holding the lock */
+static int fff_readable_unlocked(struct fftab *ffentry, FIL *fp) {
+	FSIZE_t clustsize = (FSIZE_t) fp->obj.fs->csize * FF_MAX_SS;
+	if (fp->cltbl == NULL && f_size(fp) > clustsize)
+		fff_linkmap(fp);
+	return (ffentry->flags & FFFF_RDONLY) && (fp->cltbl != NULL || f_size(fp) <= clustsize);
+}
+
+/* sequential reads: ask the kernel to load the next extents of the file
+	 (the data is read asynchronously in the page cache of the image).
+	 The window grows while the file is read sequentially, any other
+	 access pattern stops the readahead. The lock must be held */
+static void fff_readahead(struct fftab *ffentry, struct fffhandle *handle, FSIZE_t offset, size_t size) {
+	FIL *fp = &handle->file->fil;
+	FSIZE_t start, end, len;
+	off_t diskpos;
+	if (offset != handle->ra_next) {
+		handle->ra_next = offset + size;
+		handle->ra_end = 0;
+		handle->ra_window = 0;
+		return;
+	}
+	handle->ra_next = offset + size;
+	if (handle->ra_end > handle->ra_next + handle->ra_window / 2)
+		return; // most of the window is still ahead
+	if (fp->cltbl == NULL && f_size(fp) > (FSIZE_t) fp->obj.fs->csize * FF_MAX_SS)
+		return;
+	handle->ra_window = handle->ra_window == 0 ? FFF_RA_MIN :
+		handle->ra_window < FFF_RA_MAX ? handle->ra_window * 2 : FFF_RA_MAX;
+	start = handle->ra_end > handle->ra_next ? handle->ra_end : handle->ra_next;
+	end = handle->ra_next + handle->ra_window;
+	if (end > f_size(fp))
+		end = f_size(fp);
+	for (; start < end; start += len) {
+		if ((len = fff_extent(fp, start, end - start, &diskpos)) == 0)
+			break;
+		if (ffentry->map) {
+			off_t pgoff = diskpos % sysconf(_SC_PAGESIZE);
+			if (diskpos + len <= ffentry->mapsize)
+				madvise(ffentry->map + diskpos - pgoff, len + pgoff, MADV_WILLNEED);
+		} else
+			posix_fadvise(ffentry->fd, diskpos, len, POSIX_FADV_WILLNEED);
+	}
+	handle->ra_end = start;
 }
 
 static int fff_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
-	FIL fp;
+	(void) path;
+	FIL *fp = fi2fil(fi);
+	struct fftab *ffentry = fil2fftab(fp);
+	mutex_in(ffentry);
 	UINT br;
-	FRESULT fres = f_open(&fp, fffpath, flags2ffmode(fi->flags));
-	if (fres != FR_OK)
-		goto earlyerr;
-	fres = f_lseek(&fp, offset);
+	int unlocked = fff_readable_unlocked(ffentry, fp);
+	fff_readahead(ffentry, fi2handle(fi), offset, size);
+	if (unlocked) {
+		mutex_out(ffentry);
+		return fff_read_unlocked(ffentry, fp, buf, size, offset);
+	}
+	FRESULT fres = f_lseek(fp, offset);
 	if (fres != FR_OK) goto err;
-	fres = f_read(&fp, buf, size, &br);
+	fres = f_read(fp, buf, size, &br);
 	if (fres != FR_OK) goto err;
-	f_close(&fp);
-	mutex_out_return(br);
+	mutex_out_return(ffentry, br);
 err:
-	f_close(&fp);
-earlyerr:
-	mutex_out_return(fr2errno(fres));
+	mutex_out_return(ffentry, fr2errno(fres));
+}
+
+/* mapped images: the data is not copied in user space. FUSE releases the
+	 memory buffers returned by read_buf, so the buffers cannot point into the
+	 mapping: they refer to the ranges of the image file (FUSE can splice them) */
+static int fff_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+		struct fuse_file_info *fi) {
+	FIL *fp = fi2fil(fi);
+	struct fftab *ffentry = fil2fftab(fp);
+	struct fuse_bufvec *bufv;
+	if (ffentry->map) {
+		mutex_in(ffentry);
+		int unlocked = fff_readable_unlocked(ffentry, fp);
+		if (unlocked)
+			fff_readahead(ffentry, fi2handle(fi), offset, size);
+		mutex_out(ffentry);
+		if (unlocked) {
+			size_t done, count;
+			FSIZE_t len;
+			off_t diskpos;
+			if ((FSIZE_t) offset >= f_size(fp))
+				size = 0;
+			else if (size > f_size(fp) - offset)
+				size = f_size(fp) - offset;
+			for (done = count = 0; done < size; done += len, count++)
+				if ((len = fff_extent(fp, offset + done, size - done, &diskpos)) == 0)
+					return -EIO;
+			bufv = malloc(sizeof(*bufv) + (count > 0 ? count - 1 : 0) * sizeof(struct fuse_buf));
+			if (bufv == NULL)
+				return -ENOMEM;
+			*bufv = FUSE_BUFVEC_INIT(0);
+			bufv->count = count;
+			for (done = count = 0; done < size; done += len, count++) {
+				len = fff_extent(fp, offset + done, size - done, &diskpos);
+				bufv->buf[count] = (struct fuse_buf) {
+					.size = len,
+					.flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY,
+					.fd = ffentry->fd,
+					.pos = diskpos,
+				};
+			}
+			*bufp = bufv;
+			return 0;
+		}
+	}
+	bufv = malloc(sizeof(*bufv));
+	if (bufv == NULL)
+		return -ENOMEM;
+	*bufv = FUSE_BUFVEC_INIT(size);
+	bufv->buf[0].mem = malloc(size);
+	if (bufv->buf[0].mem == NULL) {
+		free(bufv);
+		return -ENOMEM;
+	}
+	int rv = fff_read(path, bufv->buf[0].mem, size, offset, fi);
+	if (rv < 0) {
+		free(bufv->buf[0].mem);
+		free(bufv);
+		return rv;
+	}
+	bufv->buf[0].size = rv;
+	*bufp = bufv;
+	return 0;
 }
 
 static int fff_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-	mutex_in();
+	(void) path;
 	struct fuse_context *cntx=fuse_get_context();
 	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
-	FIL fp;
+	mutex_in(ffentry);
+	FIL *fp = fi2fil(fi);
 	UINT bw;
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	FRESULT fres = f_open(&fp, fffpath, flags2ffmode(fi->flags));
-	if (fres != FR_OK)
-		goto earlyerr;
-	fres = f_lseek(&fp, offset);
-	if (fres != FR_OK) goto err;
-	fres = f_write(&fp, buf, size, &bw);
+		mutex_out_return(ffentry, -EROFS);
+	/* size and time of the file change */
+	if (ffentry->pathcache)
+		pathcache_del(ffentry->pathcache, fi2file(fi)->path);
+	if ((FSIZE_t) offset + size > f_size(fp)) {
+		fff_droplinkmap(fp);
+		fff_allochint(ffentry, fff_newclusters(fp, (FSIZE_t) offset + size));
+	}
+	FRESULT fres = f_lseek(fp, offset);
 	if (fres != FR_OK) goto err;
-	fres = f_sync(&fp);
+	fres = f_write(fp, buf, size, &bw);
 	if (fres != FR_OK) goto err;
-	f_close(&fp);
-	mutex_out_return(bw);
+	mutex_out_return(ffentry, bw);
 err:
-	f_close(&fp);
-earlyerr:
-	mutex_out_return(fr2errno(fres));
+	mutex_out_return(ffentry, fr2errno(fres));
+}
+
+/* f_sync issues CTRL_SYNC (write back the caches, then fdatasync) only if
+	 the file has been modified since its last sync: the entries updated by
+	 fff_syncfile skipped it, CTRL_SYNC is issued here */
+static FRESULT fff_syncdisk(struct fftab *ffentry, FIL *fp) {
+	FRESULT fres = f_sync(fp);
+	if (fres == FR_OK && ffentry->syncpending &&
+			disk_ioctl(fp->obj.fs->pdrv, CTRL_SYNC, NULL) != RES_OK)
+		fres = FR_DISK_ERR;
+	return fres;
+}
+
+static int fff_flush(const char *path, struct fuse_file_info *fi) {
+	(void) path;
+	FIL *fp = fi2fil(fi);
+	struct fftab *ffentry = fil2fftab(fp);
+	mutex_in(ffentry);
+	FRESULT fres = fff_syncdisk(ffentry, fp);
+	mutex_out_return(ffentry, fr2errno(fres));
+}
+
+static int fff_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	(void) path;
+	(void) datasync;
+	FIL *fp = fi2fil(fi);
+	struct fftab *ffentry = fil2fftab(fp);
+	mutex_in(ffentry);
+	FRESULT fres = fff_syncdisk(ffentry, fp);
+	mutex_out_return(ffentry, fr2errno(fres));
+}
+
+/* open directories: a snapshot of the entries (and of their attributes)
+	 taken by the first readdir (and again by rewinddir). The offsets passed to
+	 the filler are positions in the snapshot: large directories are returned
+	 in several calls without reading them again */
+struct fffdirent {
+	char *name;
+	struct stat st;
+};
+
+struct fffdir {
+	struct fftab *ffentry;
+	struct fffdir *next; // rw volumes: list of the open directories
+	char *path;
+	unsigned int count;
+	unsigned int size;
+	struct fffdirent *entries;
+};
+
+#define fi2dir(fi) ((struct fffdir *) (uintptr_t) (fi)->fh)
+
+static void fff_dirclear(struct fffdir *dir) {
+	unsigned int k;
+	for (k = 0; k < dir->count; k++)
+		free(dir->entries[k].name);
+	dir->count = 0;
+}
+
+/* the same pass builds the directory index of the path cache:
+	 ls -l and readdir without readdirplus (fuse2) do not read it again */
+static FRESULT fff_dirsnapshot(struct fftab *ffentry, struct fffdir *dir, const char *path) {
+	const char fffpath(ffentry->index, path);
+	DIR dp;
+	FILINFO fileinfo;
+	struct pathcache_dir *d = NULL;
+	fff_dirclear(dir);
+	fff_syncfiles(ffentry);
+	FRESULT fres = f_opendir(&dp, fffpath);
+	if (fres != FR_OK)
+		return fres;
+	if (ffentry->pathcache)
+		d = pathcache_dirbegin(ffentry->pathcache, path);
+	while ((fres = f_readdir(&dp, &fileinfo)) == FR_OK && fileinfo.fname[0] != 0) {
+		if (dir->count == dir->size) {
+			unsigned int size = dir->size == 0 ? 64 : dir->size * 2;
+			struct fffdirent *entries = realloc(dir->entries, size * sizeof(*entries));
+			if (entries == NULL) {
+				fres = FR_NOT_ENOUGH_CORE;
+				break;
+			}
+			dir->entries = entries;
+			dir->size = size;
+		}
+		struct fffdirent *entry = &dir->entries[dir->count];
+		if ((entry->name = strdup(fileinfo.fname)) == NULL) {
+			fres = FR_NOT_ENOUGH_CORE;
+			break;
+		}
+		fff_fillstat(&fileinfo, &entry->st);
+		entry->st.st_ino = fff_ino(&dp);
+		if (d != NULL)
+			pathcache_diradd(d, fileinfo.fname, fileinfo.altname, &entry->st);
+		dir->count++;
+	}
+	f_closedir(&dp);
+	if (d != NULL) {
+		if (fres == FR_OK)
+			pathcache_dirend(ffentry->pathcache, d);
+		else
+			pathcache_dirabort(d);
+	}
+	return fres;
 }
 
 static int fff_opendir(const char *path, struct fuse_file_info *fi){
-	(void) fi;
-	mutex_in();
 	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
+	struct fftab *ffentry = fff_lane_in(cntx->private_data);
 	const char fffpath(ffentry->index, path);
 	DIR dp;
 	FRESULT fres = f_opendir(&dp, fffpath);
+	if (fres != FR_OK)
+		mutex_out_return(ffentry, fr2errno(fres));
 	f_closedir(&dp);
-	mutex_out_return(fr2errno(fres));
+	struct fffdir *dir = calloc(1, sizeof(*dir));
+	if (dir == NULL)
+		mutex_out_return(ffentry, -ENOMEM);
+	if ((dir->path = strdup(path)) == NULL) {
+		free(dir);
+		mutex_out_return(ffentry, -ENOMEM);
+	}
+	dir->ffentry = ffentry;
+	if (!(ffentry->flags & FFFF_RDONLY)) {
+		dir->next = ffentry->dirs;
+		ffentry->dirs = dir;
+	}
+	fi->fh = (uintptr_t) dir;
+	/* the kernel keeps the listing: all the changes go through this mount
+		 and invalidate it */
+	FUSE3_ONLY(fi->cache_readdir = 1);
+	FUSE3_ONLY(fi->keep_cache = 1);
+	mutex_out_return(ffentry, 0);
 }
 
 static int fff_releasedir(const char *path, struct fuse_file_info *fi){
 	(void) path;
-	(void) fi;
+	struct fffdir *dir = fi2dir(fi);
+	struct fftab *ffentry = dir->ffentry;
+	if (!(ffentry->flags & FFFF_RDONLY)) {
+		struct fffdir **scan;
+		mutex_in(ffentry);
+		for (scan = &ffentry->dirs; *scan != NULL; scan = &(*scan)->next) {
+			if (*scan == dir) {
+				*scan = dir->next;
+				break;
+			}
+		}
+		mutex_out(ffentry);
+	}
+	fff_dirclear(dir);
+	free(dir->entries);
+	free(dir->path);
+	free(dir);
 	return 0;
 }
 
 static int fff_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		off_t offset, struct fuse_file_info *fi FUSE3_ONLY(, enum fuse_readdir_flags fl)){
-	(void) offset;
-	(void) fi;
-	FUSE3_ONLY((void) fl);
-	mutex_in();
-	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
-	DIR dp;
-	FRESULT fres = f_opendir(&dp, fffpath);
-	if (fres != FR_OK)
-		goto mutexout_leave;
-	filler(buf, ".", NULL, 0 FUSE3_ONLY(, 0));
-	filler(buf, "..", NULL, 0 FUSE3_ONLY(, 0));
-	while(1) {
-		FILINFO fileinfo;
-		fres = f_readdir(&dp, &fileinfo);
-		if (fres != FR_OK) break;
-		if (fileinfo.fname[0] == 0) break;
-		filler(buf, fileinfo.fname, NULL, 0 FUSE3_ONLY(, 0));
+	(void) path;
+	struct fffdir *dir = fi2dir(fi);
+	off_t k;
+	if (offset == 0) {
+		struct fuse_context *cntx=fuse_get_context();
+		struct fftab *ffentry = fff_lane_in(cntx->private_data);
+		FRESULT fres = fff_dirsnapshot(ffentry, dir, dir->path);
+		if (fres != FR_OK) {
+			fff_dirclear(dir);
+			mutex_out_return(ffentry, fr2errno(fres));
+		}
+		mutex_out(ffentry);
 	}
-	f_closedir(&dp);
-mutexout_leave:
-	mutex_out_return(fr2errno(fres));
+	/* offsets: 1 ".", 2 "..", k + 3 the k-th entry.
+		 readdirplus: the kernel gets the attributes of the entries too
+		 (and caches them as getattr replies) */
+	for (k = offset; k < (off_t) dir->count + 2; k++) {
+		if (k < 2) {
+			if (filler(buf, k == 0 ? "." : "..", NULL, k + 1 FUSE3_ONLY(, 0)))
+				break;
+		} else {
+			struct fffdirent *entry = &dir->entries[k - 2];
+#if FUSE == 2
+			if (filler(buf, entry->name, &entry->st, k + 1))
+				break;
+#else
+			if (filler(buf, entry->name, &entry->st, k + 1,
+						(fl & FUSE_READDIR_PLUS) ? FUSE_FILL_DIR_PLUS : 0))
+				break;
+#endif
+		}
+	}
+	return 0;
 }
 
 static int fff_mkdir(const char *path, mode_t mode) {
 	(void) mode;  // XXX set readonly
-	mutex_in();
 	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
+	struct fftab *ffentry = fff_lane_in(cntx->private_data);
 	const char fffpath(ffentry->index, path);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
+		mutex_out_return(ffentry, -EROFS);
+	fff_allochint(ffentry, 1);
 	FRESULT fres = f_mkdir(fffpath);
-	if (fres != FR_OK) return fr2errno(fres);
+	fff_pathchanged(ffentry, path, 0);
 	// XXX mode?
-	mutex_out_return(0);
+	mutex_out_return(ffentry, fr2errno(fres));
 }
 
 static int fff_unlink(const char *path) {
-	mutex_in();
 	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
+	struct fftab *ffentry = fff_lane_in(cntx->private_data);
 	const char fffpath(ffentry->index, path);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
+		mutex_out_return(ffentry, -EROFS);
 	// XXX ck is it reg file ?
+	/* the clusters of an open file cannot be released (see hard_remove) */
+	if (fff_findfile(ffentry, path) != NULL)
+		mutex_out_return(ffentry, -EBUSY);
 	FRESULT fres = f_unlink(fffpath);
-	mutex_out_return(fr2errno(fres));
+	fff_pathchanged(ffentry, path, fres == FR_OK);
+	mutex_out_return(ffentry, fr2errno(fres));
 }
 
 static int fff_rmdir(const char *path) {
-	mutex_in();
 	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
+	struct fftab *ffentry = fff_lane_in(cntx->private_data);
 	const char fffpath(ffentry->index, path);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
+		mutex_out_return(ffentry, -EROFS);
 	// XXX ck is it a dir ?
 	FRESULT fres = f_unlink(fffpath);
-	mutex_out_return(fr2errno(fres));
+	fff_pathchanged(ffentry, path, fres == FR_OK);
+	mutex_out_return(ffentry, fr2errno(fres));
+}
+
+/* the path of an open file or directory: path has been renamed as newpath */
+static void fff_renamepath(char **handlepath, const char *path, const char *newpath) {
+	size_t len = strlen(path);
+	if (strncmp(*handlepath, path, len) == 0 &&
+			((*handlepath)[len] == 0 || (*handlepath)[len] == '/')) {
+		char *renamed;
+		if (asprintf(&renamed, "%s%s", newpath, *handlepath + len) >= 0) {
+			free(*handlepath);
+			*handlepath = renamed;
+		}
+	}
+}
+
+/* path (and the objects below it) has been renamed: update the open handles.
+	 (FUSE renames the open files being unlinked, see hard_remove) */
+static void fff_renamed(struct fftab *ffentry, const char *path, const char *newpath) {
+	struct fffile *file;
+	struct fffdir *dir;
+	for (file = ffentry->files; file != NULL; file = file->next)
+		fff_renamepath(&file->path, path, newpath);
+	for (dir = ffentry->dirs; dir != NULL; dir = dir->next)
+		fff_renamepath(&dir->path, path, newpath);
 }
 
 static int fff_rename(const char *path, const char *newpath FUSE3_ONLY(, unsigned int flags)) {
 	FUSE3_ONLY(if(flags) return -ENOSYS;)
 
-	mutex_in();
 	struct fuse_context *cntx=fuse_get_context();
-	struct fftab *ffentry = cntx->private_data;
+	struct fftab *ffentry = fff_lane_in(cntx->private_data);
 	const char fffpath(ffentry->index, path);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
+		mutex_out_return(ffentry, -EROFS);
+	/* the directory entry of an open file is moved: see fff_movefile */
+	struct fffile *file = fff_findfile(ffentry, path);
 	FRESULT fres = f_rename(fffpath, newpath);
-	mutex_out_return(fr2errno(fres));
+	if (fres == FR_OK) {
+		if (file != NULL)
+			fff_movefile(ffentry, file, newpath);
+		fff_renamed(ffentry, path, newpath);
+	}
+	fff_pathchanged(ffentry, path, fres == FR_OK);
+	/* no entries below newpath, newpath exists */
+	fff_pathchanged(ffentry, newpath, 1);
+	fff_pathchanged(ffentry, newpath, 0);
+	mutex_out_return(ffentry, fr2errno(fres));
 }
 
 static int fff_truncate(const char *path, off_t size FUSE3_ONLY(, struct fuse_file_info *fi)) {
-	FUSE3_ONLY((void) fi);
-	mutex_in();
 	struct fuse_context *cntx=fuse_get_context();
 	struct fftab *ffentry = cntx->private_data;
-	const char fffpath(ffentry->index, path);
+	struct fffile *file;
+	FRESULT fres;
+	mutex_in(ffentry);
+	FUSE3_ONLY(if (path == NULL) path = fi2file(fi)->path);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
-	FIL fp;
-	memset(&fp, 0, sizeof(fp));
-	FRESULT fres = f_open(&fp, fffpath, FA_WRITE);
-	if (fres != FR_OK) goto openerr;
-	fres = f_lseek(&fp, size);
-	if (fres != FR_OK) goto err;
-	fres = f_truncate(&fp);
-	if (fres != FR_OK) goto err;
-	fres = f_close(&fp);
-openerr:
-	mutex_out_return(fr2errno(fres));
-err:
-	f_close(&fp);
-	mutex_out_return(fr2errno(fres));
+		mutex_out_return(ffentry, -EROFS);
+	fff_pathchanged(ffentry, path, 0);
+	/* the open handles must see the new size and cluster chain:
+		 the shared FIL of the file is truncated */
+#if FUSE != 2
+	if (fi != NULL && (fi2handle(fi)->mode & FA_WRITE)) {
+		file = fi2file(fi);
+		file->count++;
+		file->writers++;
+	} else
+#endif
+	if ((fres = fff_getfile(ffentry, path, O_WRONLY, &file)) != FR_OK)
+		mutex_out_return(ffentry, fr2errno(fres));
+	FIL *fp = &file->fil;
+	fff_droplinkmap(fp);
+	fff_allochint(ffentry, fff_newclusters(fp, size));
+	fres = f_lseek(fp, size);
+	if (fres == FR_OK)
+		fres = f_truncate(fp);
+	if (fres == FR_OK)
+		fres = f_sync(fp);
+	FRESULT closeres = fff_putfile(ffentry, file, FA_WRITE);
+	mutex_out_return(ffentry, fr2errno(fres != FR_OK ? fres : closeres));
+}
+
+/* FAT has neither holes nor clusters beyond the end of file.
+	 mode 0: the new range is allocated and zeroed. An empty file gets a
+	 contiguous cluster chain at once (f_expand), so it is written as a single
+	 extent (and exFAT sets the NoFatChain flag): the following writes do not
+	 update the FAT. FALLOC_FL_KEEP_SIZE is not supported: FAT cannot
+	 allocate clusters beyond the end of file */
+static int fff_fallocate(const char *path, int mode, off_t offset, off_t length,
+		struct fuse_file_info *fi) {
+	(void) path;
+	static const char zeros[FFF_ZEROBUF];
+	struct fffile *file = fi2file(fi);
+	FIL *fp = &file->fil;
+	struct fftab *ffentry = fil2fftab(fp);
+	FATFS *fs = fp->obj.fs;
+	FSIZE_t size = (FSIZE_t) offset + length;
+	FRESULT fres = FR_OK;
+	if (mode != 0)
+		return -EOPNOTSUPP;
+	if (offset < 0 || length <= 0)
+		return -EINVAL;
+	mutex_in(ffentry);
+	if (ffentry->flags & FFFF_RDONLY)
+		mutex_out_return(ffentry, -EROFS);
+	if (!(fi2handle(fi)->mode & FA_WRITE))
+		mutex_out_return(ffentry, -EBADF);
+	if (fs->fs_type != FS_EXFAT && size > 0xFFFFFFFF)
+		mutex_out_return(ffentry, -EFBIG);
+	if (size <= f_size(fp))
+		mutex_out_return(ffentry, 0);
+	fff_droplinkmap(fp);
+	fff_allochint(ffentry, fff_newclusters(fp, size));
+	if (f_size(fp) == 0 && fp->obj.sclust == 0) {
+		fres = f_expand(fp, size, 1);
+		if (fres == FR_DENIED) // no contiguous run
+			fres = FR_OK;
+	}
+	if (fres == FR_OK) {
+		/* zero the range: f_expand did not, f_lseek would not */
+		FSIZE_t pos = f_size(fp) == size ? 0 : f_size(fp);
+		UINT bw;
+		if (ffentry->pathcache)
+			pathcache_del(ffentry->pathcache, file->path);
+		fres = f_lseek(fp, pos);
+		while (fres == FR_OK && pos < size) {
+			UINT len = size - pos < sizeof(zeros) ? size - pos : sizeof(zeros);
+			if ((fres = f_write(fp, zeros, len, &bw)) == FR_OK && bw < len)
+				mutex_out_return(ffentry, -ENOSPC);
+			pos += bw;
+		}
+	}
+	mutex_out_return(ffentry, fr2errno(fres));
 }
 
 static int fff_utimens(const char *path, const struct timespec tv[2] FUSE3_ONLY(, struct fuse_file_info *fi)) {
-	FUSE3_ONLY((void) fi);
-	mutex_in();
 	struct fuse_context *cntx=fuse_get_context();
-  struct fftab *ffentry = cntx->private_data;
+	struct fftab *ffentry = fff_lane_in(cntx->private_data);
+	FUSE3_ONLY(if (path == NULL) path = fi2file(fi)->path);
   const char fffpath(ffentry->index, path);
 	if (ffentry->flags & FFFF_RDONLY)
-		mutex_out_return(-EROFS);
+		mutex_out_return(ffentry, -EROFS);
 	FILINFO fno;
 	struct tm tm;
 	time_t newtime = tv[1].tv_sec;
 	if (gmtime_r(&newtime, &tm) == NULL)
-		mutex_out_return(-EINVAL);
+		mutex_out_return(ffentry, -EINVAL);
 	fno.fdate =
 		/* bit15:9: Year origin from the 1980 (0..127, e.g. 37 for 2017) */
 		(((tm.tm_year - 80) & 0x7f) << 9) |
@@ -390,20 +1246,100 @@ static int fff_utimens(const char *path, const struct timespec tv[2] FUSE3_ONLY(
 		((tm.tm_min & 0x3f) << 5) |
 		/* bit4:0 Second / 2 (0..29, e.g. 25 for 50) */
 		((tm.tm_sec & 0x3f) / 2);
+	/* f_sync sets the time of a modified file: update its entry before */
+	struct fffile *file = fff_findfile(ffentry, path);
+	if (file != NULL)
+		fff_syncfile(ffentry, file);
 	FRESULT fres = f_utime(fffpath, &fno);
-	mutex_out_return(fr2errno(fres));
+	fff_pathchanged(ffentry, path, 0);
+	mutex_out_return(ffentry, fr2errno(fres));
+}
+
+/* count the next chunk of the free clusters. When the count is complete
+	 FatFs keeps fs->free_clst up to date on each allocation or release.
+	 It returns 0 while the count is in progress */
+static int fff_freecount_step(struct fftab *ffentry) {
+	FATFS *fs = &ffentry->fs;
+	int rv = freecount_step(ffentry->freecount);
+	if (rv > 0) {
+		DWORD nfree = freecount_result(ffentry->freecount);
+		if (nfree == 0xFFFFFFFF)
+			return 0;
+		fs->free_clst = nfree;
+		fs->fsi_flag |= 1;
+	}
+	if (rv != 0) {
+		freecount_free(ffentry->freecount);
+		ffentry->freecount = NULL;
+	}
+	return rv;
+}
+
+/* background thread: the lock is held for one chunk at a time */
+static void *fff_freecount(void *arg) {
+	struct fftab *ffentry = arg;
+	int done = 0;
+	while (!done) {
+		mutex_in(ffentry);
+		done = ffentry->freecount_running < 0 || ffentry->freecount == NULL ||
+			fff_freecount_step(ffentry) != 0;
+		mutex_out(ffentry);
+		sched_yield();
+	}
+	return NULL;
+}
+
+/* background thread: write back the dirty sectors every flushtime seconds */
+static void *fff_flusher(void *arg) {
+	struct fftab *ffentry = arg;
+	struct timespec deadline;
+	pthread_mutex_lock(&ffentry->flusher_mutex);
+	while (ffentry->flusher_running > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += ffentry->flushtime;
+		if (pthread_cond_timedwait(&ffentry->flusher_cond, &ffentry->flusher_mutex, &deadline) == 0)
+			continue;
+		pthread_mutex_unlock(&ffentry->flusher_mutex);
+		mutex_in(ffentry);
+		fff_syncfiles(ffentry);
+		if (fftab_flush(ffentry) < 0)
+			fprintf(stderr, "%s: cache write back failed\n", ffentry->path);
+		mutex_out(ffentry);
+		pthread_mutex_lock(&ffentry->flusher_mutex);
+	}
+	pthread_mutex_unlock(&ffentry->flusher_mutex);
+	return NULL;
 }
 
 static int fff_statfs(const char *path, struct statvfs *buf) {
 	(void) path;
-	mutex_in();
-  struct fuse_context *cntx=fuse_get_context();
-  struct fftab *ffentry = cntx->private_data;
+	struct fuse_context *cntx=fuse_get_context();
+	struct fftab *ffentry = cntx->private_data;
+	mutex_in(ffentry);
   const char fffpath(ffentry->index, "");
 	memset(buf, 0, sizeof(*buf));
-	FATFS *fs;
+	FATFS *fs = &ffentry->fs;
 	DWORD fre_clust;
-  FRESULT fres = f_getfree(fffpath, &fre_clust, &fs);
+	FRESULT fres = FR_OK;
+	if (ffentry->freecount && ffentry->freecount_running > 0)
+		/* do not wait for the background count */
+		fre_clust = freecount_estimate(ffentry->freecount);
+	else {
+		/* f_getfree scans the FAT (or the exFAT bitmap) entry by entry when the
+			 free cluster count is unknown: provide it */
+		if (fs->fs_type != 0 && fs->free_clst > fs->n_fatent - 2) {
+			if (ffentry->freemap) {
+				if (fs->wflag)
+					freemap_update(ffentry->freemap, fs->win, fs->winsect, 1);
+				fs->free_clst = freemap_count(ffentry->freemap);
+				fs->fsi_flag |= 1;
+			} else if (ffentry->freecount) {
+				while (fff_freecount_step(ffentry) == 0)
+					;
+			}
+		}
+		fres = f_getfree(fffpath, &fre_clust, &fs);
+	}
 	if (fres == FR_OK) {
 		WORD ssize =
 #if FF_MAX_SS != FF_MIN_SS
@@ -417,20 +1353,85 @@ static int fff_statfs(const char *path, struct statvfs *buf) {
 		buf->f_bfree = buf->f_bavail = (fre_clust * ssize) / S_BLKSIZE;
 		buf->f_namemax = 255;
 	}
-  mutex_out_return(fr2errno(fres));
+  mutex_out_return(ffentry, fr2errno(fres));
+}
+
+/* load the whole FAT in memory if it fits in fatcachemax */
+static void fff_fatcache(struct fftab *ffentry, size_t fatcachemax) {
+	FATFS *fs = &ffentry->fs;
+	if (fs->fs_type == FS_EXFAT) {
+		fprintf(stderr, "fatcache: not supported on exFAT volumes\n");
+		return;
+	}
+	if ((size_t) fs->fsize * FF_MAX_SS > fatcachemax) {
+		fprintf(stderr, "fatcache: FAT size %zu KiB exceeds the limit, using the sector cache\n",
+				((size_t) fs->fsize * FF_MAX_SS) >> 10);
+		return;
+	}
+	ffentry->fatcache = fatcache_new(ffentry->fd, fs, ffentry->cache, ffentry->uring);
+	if (ffentry->fatcache == NULL)
+		fprintf(stderr, "fatcache: cannot load the FAT, using the sector cache\n");
 }
 
-static struct fftab *fff_init(const char *source, int codepage, int flags) {
+/* mount the read-only image again: the lanes share the caches */
+static void fff_lanes(struct fftab *ffentry, int readers) {
+	ffentry->lane[0] = ffentry;
+	ffentry->nlanes = 1;
+	while (ffentry->nlanes < readers) {
+		int index = fftab_new(ffentry->path, ffentry->flags);
+		if (index < 0) {
+			fprintf(stderr, "readers: no more volumes, using %d lanes\n", ffentry->nlanes);
+			return;
+		}
+		struct fftab *lane = fftab_get(index);
+		char sdrv[12];
+		lane->cache = ffentry->cache;
+		lane->fatcache = ffentry->fatcache;
+		lane->pathcache = ffentry->pathcache;
+		snprintf(sdrv, 12, "%d:", index);
+		if (f_mount(&lane->fs, sdrv, 1) != FR_OK) {
+			f_mount(0, sdrv, 0);
+			lane->cache = NULL;
+			lane->fatcache = NULL;
+			lane->pathcache = NULL;
+			fftab_del(index);
+			fprintf(stderr, "readers: mount error, using %d lanes\n", ffentry->nlanes);
+			return;
+		}
+		ffentry->lane[ffentry->nlanes++] = lane;
+	}
+}
+
+static struct fftab *fff_init(const char *source, int codepage, int flags,
+		size_t cachesize, size_t dirtymax, unsigned int flushtime, size_t fatcachemax,
+		unsigned int pathcachesize, int readers) {
+	struct fftab *ffentry = NULL;
+	pthread_mutex_lock(&fff_mutex);
 	int index = fftab_new(source, flags);
 	if (index >= 0) {
-		struct fftab *ffentry = fftab_get(index);
 		char sdrv[12];
+		ffentry = fftab_get(index);
+		ffentry->cachesize = cachesize;
+		ffentry->dirtymax = dirtymax;
+		ffentry->flushtime = flushtime;
 		snprintf(sdrv, 12, "%d:", index);
 		FRESULT fres = f_mount(&ffentry->fs, sdrv, 1);
 		if (fres != FR_OK) {
+			f_mount(0, sdrv, 0);
 			fftab_del(index);
-			return NULL;
+			ffentry = NULL;
+			goto leave;
 		}
+		if (flags & FFFF_FATCACHE)
+			fff_fatcache(ffentry, fatcachemax);
+		if (!(flags & FFFF_RDONLY))
+			ffentry->freemap = freemap_new(ffentry->fd, &ffentry->fs, ffentry->fatcache, ffentry->cache);
+		/* the free cluster count is unknown: it will be computed in background */
+		if (ffentry->freemap == NULL && ffentry->fs.free_clst > ffentry->fs.n_fatent - 2)
+			ffentry->freecount = freecount_new(ffentry->fd, &ffentry->fs, ffentry->fatcache, ffentry->cache);
+		ffentry->pathcache = pathcache_new(pathcachesize);
+		if (flags & FFFF_RDONLY)
+			fff_lanes(ffentry, readers);
 		if (codepage != 0) {
 			if (f_setcp(codepage) != FR_OK) {
 				fprintf(stderr, "codepage %d unavailable\n", codepage);
@@ -438,16 +1439,95 @@ static struct fftab *fff_init(const char *source, int codepage, int flags) {
 			}
 		} else
 			f_setcp(FAT_DEFAULT_CODEPAGE);
-		return ffentry;
-	} else
-		return NULL;
+	}
+leave:
+	pthread_mutex_unlock(&fff_mutex);
+	return ffentry;
 }
 
 static void fff_destroy(struct fftab *ffentry) {
 	char sdrv[12];
+	if (ffentry->freecount_running) {
+		mutex_in(ffentry);
+		ffentry->freecount_running = -1;
+		mutex_out(ffentry);
+		pthread_join(ffentry->freecount_thread, NULL);
+	}
+	if (ffentry->flusher_running) {
+		pthread_mutex_lock(&ffentry->flusher_mutex);
+		ffentry->flusher_running = -1;
+		pthread_cond_signal(&ffentry->flusher_cond);
+		pthread_mutex_unlock(&ffentry->flusher_mutex);
+		pthread_join(ffentry->flusher_thread, NULL);
+	}
+	pthread_mutex_lock(&fff_mutex);
+	while (ffentry->nlanes > 1) {
+		struct fftab *lane = ffentry->lane[--ffentry->nlanes];
+		snprintf(sdrv, 12, "%d:", lane->index);
+		f_mount(0, sdrv, 1);
+		lane->cache = NULL;
+		lane->fatcache = NULL;
+		lane->pathcache = NULL;
+		fftab_del(lane->index);
+	}
 	snprintf(sdrv, 12, "%d:", ffentry->index);
 	f_mount(0, sdrv, 1);
+	if ((ffentry->flags & FFFF_STATS) && ffentry->cache)
+		ffcache_stats(ffentry->cache, stderr);
+	if ((ffentry->flags & FFFF_STATS) && ffentry->fatcache)
+		fatcache_stats(ffentry->fatcache, stderr);
+	if ((ffentry->flags & FFFF_STATS) && ffentry->uring)
+		ffuring_stats(ffentry->uring, stderr);
+	if ((ffentry->flags & FFFF_STATS) && ffentry->pathcache)
+		pathcache_stats(ffentry->pathcache, stderr);
 	fftab_del(ffentry->index);
+	pthread_mutex_unlock(&fff_mutex);
+}
+
+#if FUSE != 2
+/* kernel caching. All the changes go through this mount: the kernel already
+	 drops its attributes after a write and its entries after create, unlink
+	 or rename, so ENOENT can be cached too.
+	 Read-only: the image does not change, entries, attributes and pages
+	 are kept (kernel_cache). Read-write: short timeouts, the pages of a file
+	 are dropped at open if its size or time changed (auto_cache).
+	 Timeouts set by the user (-o entry_timeout=T...) are not changed */
+static void fff_fuse_config(struct fftab *ffentry, struct fuse_config *cfg) {
+	double timeout = (ffentry->flags & FFFF_RDONLY) ? FAT_RO_TIMEOUT : FAT_RW_TIMEOUT;
+	if (cfg->entry_timeout == FUSE_DEFAULT_TIMEOUT)
+		cfg->entry_timeout = timeout;
+	if (cfg->attr_timeout == FUSE_DEFAULT_TIMEOUT)
+		cfg->attr_timeout = timeout;
+	if (cfg->negative_timeout == 0)
+		cfg->negative_timeout = timeout;
+	/* open files and directories keep their path: FUSE does not build it */
+	cfg->nullpath_ok = 1;
+	/* inode numbers: see fff_ino */
+	cfg->use_ino = 1;
+	if (ffentry->flags & FFFF_RDONLY)
+		cfg->kernel_cache = 1;
+	else if (!cfg->kernel_cache)
+		cfg->auto_cache = 1;
+}
+#endif
+
+/* threads must be started here: fuse_main may fork to run in background */
+static void *fff_fuse_init(struct fuse_conn_info *conn FUSE3_ONLY(, struct fuse_config *cfg)) {
+	(void) conn;
+	struct fuse_context *cntx=fuse_get_context();
+	struct fftab *ffentry = cntx->private_data;
+	FUSE3_ONLY(fff_fuse_config(ffentry, cfg));
+	mutex_in(ffentry);
+	if (ffentry->freecount && ffentry->freecount_running == 0 &&
+			pthread_create(&ffentry->freecount_thread, NULL, fff_freecount, ffentry) == 0)
+		ffentry->freecount_running = 1;
+	if (!(ffentry->flags & FFFF_RDONLY) && ffentry->flushtime > 0 && ffentry->flusher_running == 0) {
+		ffentry->flusher_running = 1;
+		if (pthread_create(&ffentry->flusher_thread, NULL, fff_flusher, ffentry) != 0)
+			ffentry->flusher_running = 0;
+	}
+	mutex_out(ffentry);
+	return ffentry;
 }
 
 int fff_access (const char *path, int mode) {
@@ -457,12 +1537,16 @@ int fff_access (const char *path, int mode) {
 }
 
 static const struct fuse_operations fusefat_ops = {
+	.init     = fff_fuse_init,
 	.getattr  = fff_getattr,
 	.open           = fff_open,
 	.create         = fff_create,
 	.read           = fff_read,
+	.read_buf       = fff_read_buf,
 	.write          = fff_write,
 	.release        = fff_release,
+	.flush          = fff_flush,
+	.fsync          = fff_fsync,
 	.opendir        = fff_opendir,
 	.readdir        = fff_readdir,
 	.releasedir     = fff_releasedir,
@@ -471,9 +1555,14 @@ static const struct fuse_operations fusefat_ops = {
 	.rmdir          = fff_rmdir,
 	.rename         = fff_rename,
 	.truncate       = fff_truncate,
+	.fallocate      = fff_fallocate,
 	.utimens        = fff_utimens,
 	.statfs         = fff_statfs,
 	.access         = fff_access,
+#if FUSE == 2
+	.flag_nullpath_ok = 1,
+	.flag_nopath    = 1,
+#endif
 };
 
 static void usage(void)
@@ -492,6 +1581,17 @@ static void usage(void)
 			"    -o rw     enable write support only together with -force\n"
 			"    -o force  enable write support only together with -rw\n"
 			"    -o codepage=XXX  set codepage (default 850)\n"
+			"    -o cache=XXX     sector cache size in MiB (default 4, 0=disabled)\n"
+			"    -o dirtymax=XXX  max dirty data in the sector cache in MiB (default: half of the cache)\n"
+			"    -o flushtime=N   write back the sector cache every N seconds (default 5, 0=disabled)\n"
+			"    -o fatcache      keep the whole FAT in memory (FAT12/16/32)\n"
+			"    -o fatcachemax=XXX  max size in MiB of the in memory FAT (default 64)\n"
+			"    -o pathcache=N   entries of the path lookup cache (default 4096, 0=disabled)\n"
+			"    -o sync=XXX      always (O_SYNC), fsync (default) or none\n"
+			"    -o mmap          read-only: map the image in memory\n"
+			"    -o uring         use io_uring to batch the disk requests\n"
+			"    -o readers=N     read-only: serve requests in parallel on N lanes (default 1)\n"
+			"    -o stats         print cache statistics at unmount\n"
 			"\n"
 			"    this software is still experimental\n"
 			"\n");
@@ -505,6 +1605,17 @@ struct options {
 	int rwplus;
 	int force;
 	int codepage;
+	int cache;
+	int dirtymax;
+	int flushtime;
+	int fatcache;
+	int fatcachemax;
+	int pathcache;
+	const char *sync;
+	int mmap;
+	int uring;
+	int readers;
+	int stats;
 };
 
 #define FFF_OPT(t, p, v) { t, offsetof(struct options, p), v }
@@ -516,6 +1627,17 @@ static struct fuse_opt fff_opts[] =
 	FFF_OPT("rw+", rwplus, 1),
 	FFF_OPT("force", force, 1),
 	FFF_OPT("codepage=%u", codepage, 1),
+	FFF_OPT("cache=%u", cache, 1),
+	FFF_OPT("dirtymax=%u", dirtymax, 1),
+	FFF_OPT("flushtime=%u", flushtime, 1),
+	FFF_OPT("fatcache", fatcache, 1),
+	FFF_OPT("fatcachemax=%u", fatcachemax, 1),
+	FFF_OPT("pathcache=%u", pathcache, 1),
+	FFF_OPT("sync=%s", sync, 0),
+	FFF_OPT("mmap", mmap, 1),
+	FFF_OPT("uring", uring, 1),
+	FFF_OPT("readers=%u", readers, 1),
+	FFF_OPT("stats", stats, 1),
 
 	FUSE_OPT_KEY("-V", 'V'),
 	FUSE_OPT_KEY("--version", 'V'),
@@ -561,7 +1683,13 @@ fff_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
 int main(int argc, char *argv[])
 {
 	int err;
-	struct options options = {0};
+	struct options options = {
+		.cache = FAT_DEFAULT_CACHESIZE,
+		.dirtymax = -1,
+		.flushtime = FAT_DEFAULT_FLUSHTIME,
+		.fatcachemax = FAT_DEFAULT_FATCACHEMAX,
+		.pathcache = FAT_DEFAULT_PATHCACHE
+	};
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct fftab *ffentry;
 	int flags = 0;
@@ -598,10 +1726,42 @@ int main(int argc, char *argv[])
 	}
 
 	if (options.ro) flags |= FFFF_RDONLY;
-	if ((ffentry = fff_init(options.source, options.codepage, flags)) == NULL) {
+	if (options.stats) flags |= FFFF_STATS;
+	if (options.fatcache) flags |= FFFF_FATCACHE;
+	if (options.uring) flags |= FFFF_URING;
+	if (options.sync != NULL) {
+		if (strcmp(options.sync, "always") == 0)
+			flags |= FFFF_SYNC_ALWAYS;
+		else if (strcmp(options.sync, "none") == 0)
+			flags |= FFFF_SYNC_NONE;
+		else if (strcmp(options.sync, "fsync") != 0) {
+			fprintf(stderr, "sync=%s: unknown mode (always, fsync or none)\n", options.sync);
+			goto returnerr;
+		}
+	}
+	if (options.mmap) {
+		if (options.ro)
+			flags |= FFFF_MMAP;
+		else
+			fprintf(stderr, "-o mmap is ignored: read-only mounts only\n");
+	}
+	size_t dirtymax = options.dirtymax < 0 ?
+		(size_t) options.cache << 19 : // half of the cache
+		(size_t) options.dirtymax << 20;
+	if ((ffentry = fff_init(options.source, options.codepage, flags,
+					(size_t) options.cache << 20, dirtymax, options.flushtime,
+					(size_t) options.fatcachemax << 20, options.pathcache, options.readers)) == NULL) {
 		fprintf(stderr, "Fuse init error\n");
 		goto returnerr;
 	}
+#if FUSE == 2
+	/* see fff_fuse_config: the user options come later and take precedence */
+	if (flags & FFFF_RDONLY)
+		fuse_opt_insert_arg(&args, 1, "-ouse_ino,kernel_cache,entry_timeout=" FAT_RO_TIMEOUT_STR
+				",attr_timeout=" FAT_RO_TIMEOUT_STR ",negative_timeout=" FAT_RO_TIMEOUT_STR);
+	else
+		fuse_opt_insert_arg(&args, 1, "-ouse_ino,auto_cache,negative_timeout=" FAT_RW_TIMEOUT_STR);
+#endif
 	err = fuse_main(args.argc, args.argv, &fusefat_ops, ffentry);
 	fff_destroy(ffentry);
 	fuse_opt_free_args(&args);
@@ -0,0 +1,616 @@
+/**
+ * Copyright (c) 2020 Renzo Davoli <renzo@cs.unibo.it>
+ *
+ * This program  is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ff.h>
+#include <pathcache.h>
+
+/* f_stat resolves the path component by component: each component is a
+	 linear scan of its directory. getattr storms (ls -l, find, rsync) look up
+	 the same paths again and again: this cache maps each path to the
+	 attributes returned by getattr, or records that the path does not exist
+	 (negative entries, at most a quarter of the cache). The callers drop the
+	 entries of the paths modified by write, create, rename and so on.
+	 Keys are the paths as FatFs compares them: upper case (ff_wtoupper),
+	 without the trailing dots and spaces of each name.
+	 Directory indexes: all the names of a directory (read once by the caller)
+	 in a hash table. A name missing from the index does not exist, so lookups
+	 in large directories cost O(1) instead of a scan (getattr only: f_open and
+	 f_mkdir search the directory on their own). Modified names are kept
+	 with unknown attributes, removed names are deleted from the index.
+	 The cache is shared by the lanes of a read-only volume: it has its own mutex */
+
+struct pathcache_entry {
+	struct pathcache_entry *hnext;
+	struct pathcache_entry *prev;
+	struct pathcache_entry *next;
+	uint32_t hash;
+	int negative;
+	struct stat st;
+	char key[];
+};
+
+/* getattr sets size, mode, nlink, times and inode only: nlink and ctime are derived */
+struct pathcache_name {
+	struct pathcache_name *hnext;
+	uint32_t hash;
+	int known; // attributes are valid
+	off_t size;
+	time_t mtime;
+	mode_t mode;
+	ino_t ino;
+	char name[];
+};
+
+struct pathcache_dir {
+	struct pathcache_dir *hnext;
+	struct pathcache_dir *prev;
+	struct pathcache_dir *next;
+	uint32_t hash;
+	int noindex; // too large or with short name aliases: do not index it again
+	unsigned int nnames;
+	uint32_t nmask;
+	struct pathcache_name **names;
+	char key[];
+};
+
+struct pathcache {
+	pthread_mutex_t mutex;
+	unsigned int size[2]; // max entries: positive, negative
+	unsigned int count[2];
+	uint32_t hmask;
+	struct pathcache_entry **htable;
+	struct pathcache_entry *head[2]; // most recently used
+	struct pathcache_entry *tail[2]; // least recently used
+	uint64_t hits;
+	uint64_t neghits;
+	uint64_t misses;
+	/* directory indexes */
+	unsigned int maxnames;
+	unsigned int nnames;
+	struct pathcache_dir **dtable;
+	struct pathcache_dir *dhead;
+	struct pathcache_dir *dtail;
+	uint64_t dirhits;
+	uint64_t dirbuilds;
+};
+
+static size_t utf8_decode(const char *s, DWORD *uni) {
+	const unsigned char *u = (const unsigned char *) s;
+	if (u[0] < 0x80) {
+		*uni = u[0];
+		return 1;
+	}
+	if ((u[0] & 0xe0) == 0xc0 && (u[1] & 0xc0) == 0x80) {
+		*uni = ((u[0] & 0x1f) << 6) | (u[1] & 0x3f);
+		return 2;
+	}
+	if ((u[0] & 0xf0) == 0xe0 && (u[1] & 0xc0) == 0x80 && (u[2] & 0xc0) == 0x80) {
+		*uni = ((u[0] & 0x0f) << 12) | ((u[1] & 0x3f) << 6) | (u[2] & 0x3f);
+		return 3;
+	}
+	*uni = 0xFFFFFFFF; // not a BMP character: copied as is
+	return 1;
+}
+
+static size_t utf8_encode(char *s, DWORD uni) {
+	if (uni < 0x80) {
+		s[0] = uni;
+		return 1;
+	}
+	if (uni < 0x800) {
+		s[0] = 0xc0 | (uni >> 6);
+		s[1] = 0x80 | (uni & 0x3f);
+		return 2;
+	}
+	s[0] = 0xe0 | (uni >> 12);
+	s[1] = 0x80 | ((uni >> 6) & 0x3f);
+	s[2] = 0x80 | (uni & 0x3f);
+	return 3;
+}
+
+/* key must be 3 * strlen(path) + 1 bytes long (a BMP character is up to 3 bytes) */
+static void fold(char *key, const char *path) {
+	char *name = key; // start of the current name in key
+	char *end;
+	DWORD uni;
+	size_t len;
+	while (*path) {
+		if (*path == '/') {
+			/* trailing dots and spaces are ignored by FatFs */
+			for (end = key; end > name && (end[-1] == '.' || end[-1] == ' '); end--)
+				;
+			if (end > name)
+				key = end;
+			*key++ = *path++;
+			name = key;
+			continue;
+		}
+		len = utf8_decode(path, &uni);
+		if (uni == 0xFFFFFFFF)
+			*key++ = *path;
+		else
+			key += utf8_encode(key, ff_wtoupper(uni));
+		path += len;
+	}
+	for (end = key; end > name && (end[-1] == '.' || end[-1] == ' '); end--)
+		;
+	if (end > name)
+		key = end;
+	*key = 0;
+}
+
+static uint32_t hash(const char *key) {
+	uint32_t h = 2166136261u; // FNV-1a
+	for (; *key; key++)
+		h = (h ^ (unsigned char) *key) * 16777619u;
+	return h;
+}
+
+/* the directory indexes hold up to PATHCACHE_NAMES names per path cache entry */
+#define PATHCACHE_NAMES 16
+
+#define folded_key(key, path) \
+	key[3 * strlen(path) + 1]; \
+	fold(key, path)
+
+static struct pathcache_entry *lookup(struct pathcache *pc, const char *key, uint32_t h) {
+	struct pathcache_entry *e;
+	for (e = pc->htable[h & pc->hmask]; e != NULL; e = e->hnext)
+		if (e->hash == h && strcmp(e->key, key) == 0)
+			break;
+	return e;
+}
+
+static void lru_unlink(struct pathcache *pc, struct pathcache_entry *e) {
+	int l = e->negative;
+	if (e->prev) e->prev->next = e->next; else pc->head[l] = e->next;
+	if (e->next) e->next->prev = e->prev; else pc->tail[l] = e->prev;
+	pc->count[l]--;
+}
+
+static void lru_push(struct pathcache *pc, struct pathcache_entry *e) {
+	int l = e->negative;
+	e->prev = NULL;
+	e->next = pc->head[l];
+	if (pc->head[l]) pc->head[l]->prev = e; else pc->tail[l] = e;
+	pc->head[l] = e;
+	pc->count[l]++;
+}
+
+static void drop(struct pathcache *pc, struct pathcache_entry *e) {
+	struct pathcache_entry **scan;
+	for (scan = &pc->htable[e->hash & pc->hmask]; *scan != e; scan = &(*scan)->hnext)
+		;
+	*scan = e->hnext;
+	lru_unlink(pc, e);
+	free(e);
+}
+
+/* key is split in parent directory and name (NULL for the root directory) */
+static char *lastname(char *key) {
+	char *slash = strrchr(key, '/');
+	if (slash == NULL || slash[1] == 0)
+		return NULL;
+	*slash = 0;
+	return slash + 1;
+}
+
+static struct pathcache_dir *dir_lookup(struct pathcache *pc, const char *key) {
+	uint32_t h = hash(key);
+	struct pathcache_dir *d;
+	for (d = pc->dtable[h & pc->hmask]; d != NULL; d = d->hnext)
+		if (d->hash == h && strcmp(d->key, key) == 0)
+			break;
+	return d;
+}
+
+static struct pathcache_name *name_lookup(struct pathcache_dir *d, const char *name) {
+	uint32_t h = hash(name);
+	struct pathcache_name *n;
+	if (d->names == NULL)
+		return NULL;
+	for (n = d->names[h & d->nmask]; n != NULL; n = n->hnext)
+		if (n->hash == h && strcmp(n->name, name) == 0)
+			break;
+	return n;
+}
+
+/* the table grows to keep the chains short */
+static void name_rehash(struct pathcache_dir *d) {
+	uint32_t nsize = (d->nmask + 1) * 2, k;
+	struct pathcache_name **names = calloc(nsize, sizeof(*names));
+	struct pathcache_name *n, *next;
+	if (names == NULL)
+		return;
+	for (k = 0; k <= d->nmask; k++) {
+		for (n = d->names[k]; n != NULL; n = next) {
+			next = n->hnext;
+			n->hnext = names[n->hash & (nsize - 1)];
+			names[n->hash & (nsize - 1)] = n;
+		}
+	}
+	free(d->names);
+	d->names = names;
+	d->nmask = nsize - 1;
+}
+
+static struct pathcache_name *name_add(struct pathcache_dir *d, const char *name) {
+	size_t namelen = strlen(name) + 1;
+	struct pathcache_name *n;
+	if (d->names == NULL) {
+		if ((d->names = calloc(16, sizeof(*d->names))) == NULL)
+			return NULL;
+		d->nmask = 15;
+	}
+	if ((n = malloc(sizeof(*n) + namelen)) == NULL)
+		return NULL;
+	memcpy(n->name, name, namelen);
+	n->hash = hash(name);
+	n->known = 0;
+	n->hnext = d->names[n->hash & d->nmask];
+	d->names[n->hash & d->nmask] = n;
+	if (++d->nnames > 2 * (d->nmask + 1))
+		name_rehash(d);
+	return n;
+}
+
+static void name_del(struct pathcache_dir *d, const char *name) {
+	struct pathcache_name **scan, *n;
+	if (d->names == NULL)
+		return;
+	for (scan = &d->names[hash(name) & d->nmask]; (n = *scan) != NULL; scan = &n->hnext) {
+		if (strcmp(n->name, name) == 0) {
+			*scan = n->hnext;
+			d->nnames--;
+			free(n);
+			return;
+		}
+	}
+}
+
+static void names_free(struct pathcache_dir *d) {
+	uint32_t k;
+	struct pathcache_name *n, *next;
+	if (d->names) {
+		for (k = 0; k <= d->nmask; k++)
+			for (n = d->names[k]; n != NULL; n = next) {
+				next = n->hnext;
+				free(n);
+			}
+		free(d->names);
+	}
+	d->names = NULL;
+	d->nnames = 0;
+}
+
+static void dir_free(struct pathcache_dir *d) {
+	names_free(d);
+	free(d);
+}
+
+static void dir_drop(struct pathcache *pc, struct pathcache_dir *d) {
+	struct pathcache_dir **scan;
+	for (scan = &pc->dtable[d->hash & pc->hmask]; *scan != d; scan = &(*scan)->hnext)
+		;
+	*scan = d->hnext;
+	if (d->prev) d->prev->next = d->next; else pc->dhead = d->next;
+	if (d->next) d->next->prev = d->prev; else pc->dtail = d->prev;
+	pc->nnames -= d->nnames + 1;
+	dir_free(d);
+}
+
+static void dir_touch(struct pathcache *pc, struct pathcache_dir *d) {
+	if (pc->dhead != d) {
+		if (d->prev) d->prev->next = d->next;
+		if (d->next) d->next->prev = d->prev; else pc->dtail = d->prev;
+		d->prev = NULL;
+		d->next = pc->dhead;
+		pc->dhead->prev = d;
+		pc->dhead = d;
+	}
+}
+
+struct pathcache *pathcache_new(unsigned int size) {
+	uint32_t hsize;
+	struct pathcache *pc;
+	if (size == 0)
+		return NULL;
+	for (hsize = 1; hsize < size; hsize <<= 1)
+		;
+	pc = calloc(1, sizeof(*pc));
+	if (pc == NULL)
+		return NULL;
+	pc->htable = calloc(hsize, sizeof(struct pathcache_entry *));
+	pc->dtable = calloc(hsize, sizeof(struct pathcache_dir *));
+	if (pc->htable == NULL || pc->dtable == NULL) {
+		free(pc->htable);
+		free(pc->dtable);
+		free(pc);
+		return NULL;
+	}
+	pc->maxnames = size * PATHCACHE_NAMES;
+	pc->size[0] = size;
+	pc->size[1] = size / 4 > 0 ? size / 4 : 1;
+	pc->hmask = hsize - 1;
+	pthread_mutex_init(&pc->mutex, NULL);
+	return pc;
+}
+
+void pathcache_free(struct pathcache *pc) {
+	while (pc->head[0])
+		drop(pc, pc->head[0]);
+	while (pc->head[1])
+		drop(pc, pc->head[1]);
+	while (pc->dhead)
+		dir_drop(pc, pc->dhead);
+	pthread_mutex_destroy(&pc->mutex);
+	free(pc->htable);
+	free(pc->dtable);
+	free(pc);
+}
+
+int pathcache_get(struct pathcache *pc, const char *path, struct stat *st) {
+	char folded_key(key, path);
+	uint32_t h = hash(key);
+	struct pathcache_entry *e;
+	struct pathcache_dir *d;
+	struct pathcache_name *n;
+	char *name;
+	int rv = 0;
+	/* see put */
+	if (strchr(path, '~') != NULL)
+		return 0;
+	pthread_mutex_lock(&pc->mutex);
+	e = lookup(pc, key, h);
+	if (e == NULL && (name = lastname(key)) != NULL &&
+			(d = dir_lookup(pc, key)) != NULL && !d->noindex) {
+		dir_touch(pc, d);
+		if ((n = name_lookup(d, name)) == NULL) {
+			pc->dirhits++;
+			rv = -1;
+		} else if (n->known) {
+			pc->dirhits++;
+			memset(st, 0, sizeof(*st));
+			st->st_size = n->size;
+			st->st_mode = n->mode;
+			st->st_nlink = S_ISDIR(n->mode) ? 2 : 1;
+			st->st_mtime = st->st_ctime = n->mtime;
+			st->st_ino = n->ino;
+			rv = 1;
+		} else
+			pc->misses++;
+	} else if (e != NULL) {
+		if (e->negative) {
+			pc->neghits++;
+			rv = -1;
+		} else {
+			pc->hits++;
+			*st = e->st;
+			rv = 1;
+		}
+		if (pc->head[e->negative] != e) {
+			lru_unlink(pc, e);
+			lru_push(pc, e);
+		}
+	} else
+		pc->misses++;
+	pthread_mutex_unlock(&pc->mutex);
+	return rv;
+}
+
+static void put(struct pathcache *pc, const char *path, const struct stat *st) {
+	/* FAT: a name with a '~' may be the short name of another entry
+		 (LONGFI~1.TXT is longfilename.txt): it cannot be invalidated */
+	if (strchr(path, '~') != NULL)
+		return;
+	char folded_key(key, path);
+	uint32_t h = hash(key);
+	int negative = (st == NULL);
+	struct pathcache_entry *e;
+	pthread_mutex_lock(&pc->mutex);
+	e = lookup(pc, key, h);
+	if (e != NULL)
+		drop(pc, e);
+	if (pc->count[negative] >= pc->size[negative])
+		drop(pc, pc->tail[negative]);
+	size_t keylen = strlen(key) + 1;
+	e = malloc(sizeof(*e) + keylen);
+	if (e != NULL) {
+		memcpy(e->key, key, keylen);
+		e->hash = h;
+		e->negative = negative;
+		if (st)
+			e->st = *st;
+		e->hnext = pc->htable[h & pc->hmask];
+		pc->htable[h & pc->hmask] = e;
+		lru_push(pc, e);
+	}
+	pthread_mutex_unlock(&pc->mutex);
+}
+
+void pathcache_put(struct pathcache *pc, const char *path, const struct stat *st) {
+	put(pc, path, st);
+}
+
+void pathcache_putnegative(struct pathcache *pc, const char *path) {
+	put(pc, path, NULL);
+}
+
+void pathcache_del(struct pathcache *pc, const char *path) {
+	char folded_key(key, path);
+	struct pathcache_entry *e;
+	struct pathcache_dir *d;
+	struct pathcache_name *n;
+	char *name;
+	pthread_mutex_lock(&pc->mutex);
+	if ((e = lookup(pc, key, hash(key))) != NULL)
+		drop(pc, e);
+	/* the name exists (it may be new): its attributes are unknown */
+	if ((name = lastname(key)) != NULL && (d = dir_lookup(pc, key)) != NULL && !d->noindex) {
+		if ((n = name_lookup(d, name)) != NULL)
+			n->known = 0;
+		else if (name_add(d, name) != NULL)
+			pc->nnames++;
+		else
+			dir_drop(pc, d);
+	}
+	pthread_mutex_unlock(&pc->mutex);
+}
+
+void pathcache_delprefix(struct pathcache *pc, const char *path) {
+	char folded_key(key, path);
+	size_t keylen = strlen(key);
+	struct pathcache_entry *e, *next;
+	struct pathcache_dir *d, *dnext;
+	char *name;
+	int l;
+	pthread_mutex_lock(&pc->mutex);
+	for (l = 0; l < 2; l++) {
+		for (e = pc->head[l]; e != NULL; e = next) {
+			next = e->next;
+			if (strncmp(e->key, key, keylen) == 0 && (e->key[keylen] == 0 || e->key[keylen] == '/'))
+				drop(pc, e);
+		}
+	}
+	for (d = pc->dhead; d != NULL; d = dnext) {
+		dnext = d->next;
+		if (strncmp(d->key, key, keylen) == 0 && (d->key[keylen] == 0 || d->key[keylen] == '/'))
+			dir_drop(pc, d);
+	}
+	if ((name = lastname(key)) != NULL && (d = dir_lookup(pc, key)) != NULL && !d->noindex) {
+		unsigned int nnames = d->nnames;
+		name_del(d, name);
+		pc->nnames -= nnames - d->nnames;
+	}
+	pthread_mutex_unlock(&pc->mutex);
+}
+
+void pathcache_delnegative(struct pathcache *pc, const char *dir) {
+	char folded_key(key, dir);
+	size_t keylen = strlen(key);
+	struct pathcache_entry *e, *next;
+	pthread_mutex_lock(&pc->mutex);
+	for (e = pc->head[1]; e != NULL; e = next) {
+		next = e->next;
+		if (strncmp(e->key, key, keylen) == 0 && e->key[keylen] == '/' &&
+				strchr(e->key + keylen + 1, '/') == NULL)
+			drop(pc, e);
+	}
+	pthread_mutex_unlock(&pc->mutex);
+}
+
+int pathcache_needindex(struct pathcache *pc, const char *path) {
+	if (strchr(path, '~') != NULL)
+		return 0;
+	char folded_key(key, path);
+	int rv = 0;
+	if (lastname(key) != NULL) {
+		pthread_mutex_lock(&pc->mutex);
+		rv = dir_lookup(pc, key) == NULL;
+		pthread_mutex_unlock(&pc->mutex);
+	}
+	return rv;
+}
+
+struct pathcache_dir *pathcache_dirbegin(struct pathcache *pc, const char *dir) {
+	(void) pc;
+	char folded_key(key, dir);
+	if (strcmp(key, "/") == 0)
+		key[0] = 0; // the root directory: see lastname
+	size_t keylen = strlen(key) + 1;
+	struct pathcache_dir *d = calloc(1, sizeof(*d) + keylen);
+	if (d != NULL) {
+		memcpy(d->key, key, keylen);
+		d->hash = hash(key);
+	}
+	return d;
+}
+
+void pathcache_diradd(struct pathcache_dir *d, const char *name, const char *alias,
+		const struct stat *st) {
+	if (d->noindex)
+		return;
+	char folded_key(key, name);
+	struct pathcache_name *n = name_add(d, key);
+	if (n == NULL) {
+		d->noindex = 1;
+		return;
+	}
+	n->known = 1;
+	n->size = st->st_size;
+	n->mtime = st->st_mtime;
+	n->mode = st->st_mode;
+	n->ino = st->st_ino;
+	/* a short name which is not the upper case version of the long name
+		 could not be invalidated when the long name changes */
+	if (alias != NULL && *alias != 0 && strchr(alias, '~') == NULL) {
+		char folded_key(akey, alias);
+		if (strcmp(akey, key) != 0)
+			d->noindex = 1;
+	}
+}
+
+void pathcache_dirend(struct pathcache *pc, struct pathcache_dir *d) {
+	struct pathcache_dir *old;
+	pthread_mutex_lock(&pc->mutex);
+	if ((old = dir_lookup(pc, d->key)) != NULL)
+		dir_drop(pc, old);
+	if (d->nnames + 1 > pc->maxnames)
+		d->noindex = 1;
+	if (d->noindex)
+		names_free(d);
+	while (pc->dtail != NULL && pc->nnames + d->nnames + 1 > pc->maxnames)
+		dir_drop(pc, pc->dtail);
+	d->hnext = pc->dtable[d->hash & pc->hmask];
+	pc->dtable[d->hash & pc->hmask] = d;
+	d->prev = NULL;
+	d->next = pc->dhead;
+	if (pc->dhead) pc->dhead->prev = d; else pc->dtail = d;
+	pc->dhead = d;
+	pc->nnames += d->nnames + 1;
+	pc->dirbuilds++;
+	pthread_mutex_unlock(&pc->mutex);
+}
+
+void pathcache_dirabort(struct pathcache_dir *d) {
+	dir_free(d);
+}
+
+int pathcache_samepath(const char *path1, const char *path2) {
+	char folded_key(key1, path1);
+	char folded_key(key2, path2);
+	return strcmp(key1, key2) == 0;
+}
+
+void pathcache_stats(struct pathcache *pc, FILE *f) {
+	uint64_t total = pc->hits + pc->neghits + pc->dirhits + pc->misses;
+	fprintf(f, "path cache: %u/%u entries, %u/%u negative, %llu hits, %llu negative hits, "
+			"%llu misses (%.1f%% hit rate)\n",
+			pc->count[0], pc->size[0], pc->count[1], pc->size[1],
+			(unsigned long long) pc->hits, (unsigned long long) pc->neghits,
+			(unsigned long long) pc->misses,
+			total ? 100.0 * (pc->hits + pc->neghits + pc->dirhits) / total : 0.0);
+	fprintf(f, "directory index: %u/%u names, %llu directories read, %llu hits\n",
+			pc->nnames, pc->maxnames,
+			(unsigned long long) pc->dirbuilds, (unsigned long long) pc->dirhits);
+}
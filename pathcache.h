@@ -0,0 +1,45 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+#include <stdio.h>
+#include <sys/stat.h>
+
+/* LRU cache of the attributes of the objects, keyed by path.
+	 Paths are case folded: different spellings of the same name share
+	 the same entry */
+struct pathcache;
+
+/* at most size entries (and size / 4 negative entries) */
+struct pathcache *pathcache_new(unsigned int size);
+void pathcache_free(struct pathcache *pc);
+
+/* it returns 1 and fills st if path is in the cache, -1 if the cache
+	 knows that path does not exist, 0 otherwise */
+int pathcache_get(struct pathcache *pc, const char *path, struct stat *st);
+void pathcache_put(struct pathcache *pc, const char *path, const struct stat *st);
+void pathcache_putnegative(struct pathcache *pc, const char *path);
+
+/* path has been modified or created: drop its entry */
+void pathcache_del(struct pathcache *pc, const char *path);
+/* path has been renamed or removed: drop it and all the objects below it */
+void pathcache_delprefix(struct pathcache *pc, const char *path);
+/* a name has been added to the directory dir: drop its negative entries */
+void pathcache_delnegative(struct pathcache *pc, const char *dir);
+
+/* directory indexes (see pathcache.c). pathcache_needindex returns 1 if the
+	 directory of path has not been indexed: the caller reads the whole directory:
+	 pathcache_dirbegin, pathcache_diradd for each entry (alias is its short name)
+	 and pathcache_dirend (or pathcache_dirabort in case of error) */
+struct pathcache_dir;
+int pathcache_needindex(struct pathcache *pc, const char *path);
+struct pathcache_dir *pathcache_dirbegin(struct pathcache *pc, const char *dir);
+void pathcache_diradd(struct pathcache_dir *d, const char *name, const char *alias,
+		const struct stat *st);
+void pathcache_dirend(struct pathcache *pc, struct pathcache_dir *d);
+void pathcache_dirabort(struct pathcache_dir *d);
+
+/* 1 if path1 and path2 are the same path for FatFs (case folded) */
+int pathcache_samepath(const char *path1, const char *path2);
+
+void pathcache_stats(struct pathcache *pc, FILE *f);
+
+#endif